@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alias.h"
+#include "parser.h"
+
+/**
+ * Aliases, expanded right after a line is split into tokens.
+ *
+ * Each alias value is tokenized once, when it is defined, and kept in a
+ * hash table; expansion splices the stored tokens into the line's token
+ * array, so no re-parsing happens per use. An alias whose value starts
+ * with another alias is expanded again, but never the same alias twice.
+ * The line's tokens then point into the alias, so an alias removed or
+ * redefined by that line is retired, and only freed by alias_collect
+ * once the line is done.
+ */
+
+#define ALIAS_BUCKETS 128
+#define ALIAS_DEPTH 16
+
+typedef struct alias_t {
+	char *name;
+	char *value;          /* As defined, for listing */
+	char *buf;            /* Tokenized copy of the value */
+	char **tokens;        /* Tokens of the value, NULL terminated */
+	int ntokens;
+	struct alias_t *next;
+} alias;
+
+static alias *aliases[ALIAS_BUCKETS];
+static alias *retired;           /* Removed, maybe still in use */
+
+static unsigned alias_hash(const char *s) {
+	unsigned h = 2166136261u;
+	while (*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h % ALIAS_BUCKETS;
+}
+
+static alias *alias_lookup(const char *name) {
+	alias *a;
+	for (a = aliases[alias_hash(name)]; a; a = a->next) {
+		if (!strcmp(a->name, name)) {
+			return a;
+		}
+	}
+	return NULL;
+}
+
+static void alias_free(alias *a) {
+	free(a->name);
+	free(a->value);
+	free(a->buf);
+	free(a->tokens);
+	free(a);
+}
+
+static void alias_remove(const char *name) {
+	alias **p;
+	for (p = &aliases[alias_hash(name)]; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, name)) {
+			alias *a = *p;
+			*p = a->next;
+			a->next = retired;
+			retired = a;
+			return;
+		}
+	}
+}
+
+/* Free the aliases removed while lines were using them */
+void alias_collect(void) {
+	while (retired) {
+		alias *a = retired;
+		retired = a->next;
+		alias_free(a);
+	}
+}
+
+static void alias_define(const char *name, const char *value) {
+	alias_remove(name);
+
+	alias *a = malloc(sizeof(alias));
+	a->name = strdup(name);
+	a->value = strdup(value);
+	a->buf = strdup(value);
+	a->tokens = malloc((strlen(value) + 2) * sizeof(char *));
+	parse_line(a->buf, a->tokens);
+	for (a->ntokens = 0; a->tokens[a->ntokens]; a->ntokens++)
+		;
+
+	unsigned h = alias_hash(name);
+	a->next = aliases[h];
+	aliases[h] = a;
+}
+
+/* Expand aliases in command position, in place; max bounds the array */
+void expand_aliases(char **tokens, int max) {
+	int n = 0, i = 0;
+	while (tokens[n]) {
+		n++;
+	}
+
+	while (tokens[i]) {
+		const char *used[ALIAS_DEPTH];
+		int depth = 0, j;
+		alias *a;
+
+		while (tokens[i] && depth < ALIAS_DEPTH &&
+		       (a = alias_lookup(tokens[i]))) {
+			for (j = 0; j < depth && strcmp(used[j], a->name); j++)
+				;
+			if (j < depth || n + a->ntokens > max - 1) {
+				break;
+			}
+			used[depth++] = a->name;
+			memmove(&tokens[i + a->ntokens], &tokens[i + 1],
+				(n - i) * sizeof(char *));
+			memcpy(&tokens[i], a->tokens, a->ntokens * sizeof(char *));
+			n += a->ntokens - 1;
+		}
+
+		/* Move on to the next command position */
+		while (tokens[i] && !is_operator(tokens[i])) {
+			i++;
+		}
+		if (tokens[i]) {
+			i++;
+		}
+	}
+}
+
+static void print_alias(alias *a) {
+	printf("alias %s='%s'\n", a->name, a->value);
+}
+
+/**
+ * Defines aliases. The value is everything after '=', including the
+ * following words, so both "alias ll=ls -l" and "alias ll='ls -l'" work.
+ * Without arguments, lists all aliases; "alias name" shows one.
+ */
+int execute_alias(char **words) {
+	int i, status = EXIT_SUCCESS;
+
+	if (!words[1]) {
+		for (i = 0; i < ALIAS_BUCKETS; i++) {
+			alias *a;
+			for (a = aliases[i]; a; a = a->next) {
+				print_alias(a);
+			}
+		}
+		return status;
+	}
+
+	for (i = 1; words[i]; i++) {
+		char *eq = strchr(words[i], '=');
+		if (!eq) {
+			alias *a = alias_lookup(words[i]);
+			if (a) {
+				print_alias(a);
+			}
+			else {
+				fprintf(stderr, "alias: %s: not found\n", words[i]);
+				status = EXIT_FAILURE;
+			}
+			continue;
+		}
+
+		/* Join the rest of the words back into one value */
+		size_t len = strlen(eq + 1) + 1;
+		int j;
+		for (j = i + 1; words[j]; j++) {
+			len += strlen(words[j]) + 1;
+		}
+		char *value = malloc(len);
+		strcpy(value, eq + 1);
+		for (j = i + 1; words[j]; j++) {
+			strcat(value, " ");
+			strcat(value, words[j]);
+		}
+		size_t n = strlen(value);
+		if (n >= 2 && (value[0] == '\'' || value[0] == '"') &&
+		    value[n-1] == value[0]) {
+			value[n-1] = '\0';
+			memmove(value, value + 1, n - 1);
+		}
+
+		*eq = '\0';
+		alias_define(words[i], value);
+		*eq = '=';
+		free(value);
+		break;
+	}
+	return status;
+}
+
+/**
+ * Removes aliases.
+ */
+int execute_unalias(char **words) {
+	int i;
+	for (i = 1; words[i]; i++) {
+		alias_remove(words[i]);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#ifndef __ALIAS_H__
+#define __ALIAS_H__
+
+/* Expand aliases in command position, in place; max bounds the array */
+void expand_aliases(char **tokens, int max);
+
+/* Free the aliases removed or redefined since the last call; no line's
+ * tokens may still point into them */
+void alias_collect(void);
+
+/* Builtins: alias [name[=value]...], unalias name... */
+int execute_alias(char **words);
+int execute_unalias(char **words);
+
+#endif
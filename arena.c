@@ -0,0 +1,40 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* Use size bytes at buf as an empty arena */
+void arena_init(arena *a, void *buf, size_t size) {
+	a->base = buf;
+	a->size = size;
+	a->used = 0;
+}
+
+/* Allocate size bytes, aligned for any type; NULL if the arena is full */
+void *arena_alloc(arena *a, size_t size) {
+	size_t align = alignof(max_align_t);
+	size_t start = ((uintptr_t)a->base + a->used + align - 1) & ~(align - 1);
+	start -= (uintptr_t)a->base;
+	if (start > a->size || size > a->size - start) {
+		return NULL;
+	}
+	a->used = start + size;
+	return a->base + start;
+}
+
+/* Copy a string into the arena; NULL if it is full */
+char *arena_strdup(arena *a, const char *s) {
+	size_t len = strlen(s) + 1;
+	char *copy = arena_alloc(a, len);
+	if (copy) {
+		memcpy(copy, s, len);
+	}
+	return copy;
+}
+
+/* Forget everything allocated so far */
+void arena_reset(arena *a) {
+	a->used = 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* A bump allocator over memory the caller owns: nothing is freed on its
+ * own, the whole arena is reset at once */
+typedef struct arena {
+	char *base;
+	size_t size, used;
+} arena;
+
+/* Use size bytes at buf as an empty arena */
+void arena_init(arena *a, void *buf, size_t size);
+
+/* Allocate size bytes, aligned for any type; NULL if the arena is full */
+void *arena_alloc(arena *a, size_t size);
+
+/* Copy a string into the arena; NULL if it is full */
+char *arena_strdup(arena *a, const char *s);
+
+/* Forget everything allocated so far */
+void arena_reset(arena *a);
+
+#endif
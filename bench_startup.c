@@ -0,0 +1,67 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Startup benchmark: time from spawning "SHELL -c /bin/true" until it
+ * exits, averaged over many runs. Spawning /bin/true directly gives the
+ * baseline, so the difference is what the shell itself costs before it
+ * gets to exec its first command.
+ *
+ * usage: bench_startup RUNS SHELL...
+ */
+
+extern char **environ;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Mean microseconds per run of argv, or -1 if it can't be spawned */
+static double bench(char **argv, int runs) {
+	int i;
+	double start = now();
+	for (i = 0; i < runs; i++) {
+		pid_t pid;
+		int status;
+		if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ)) {
+			return -1;
+		}
+		if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) == 127) {
+			return -1;
+		}
+	}
+	return (now() - start) * 1e6 / runs;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s RUNS SHELL...\n", argv[0]);
+		return 1;
+	}
+	int runs = atoi(argv[1]), i;
+
+	char *direct[] = { "/bin/true", NULL };
+	double base = bench(direct, runs);
+	printf("%-16s %8.1f us\n", "/bin/true", base);
+
+	for (i = 2; i < argc; i++) {
+		char *cmd[] = { argv[i], "-c", "/bin/true", NULL };
+		double t = bench(cmd, runs);
+		if (t < 0) {
+			printf("%-16s (not available)\n", argv[i]);
+			continue;
+		}
+		printf("%-16s %8.1f us  (+%.1f us startup)\n", argv[i], t,
+		       t - base);
+	}
+	return 0;
+}
@@ -0,0 +1,231 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cmdlog.h"
+#include "dirstack.h"
+
+/**
+ * Always-on command execution log.
+ *
+ * Every executed command and pipeline is written to a fixed-size ring of
+ * slots in a shared file mapping ($MYSHELL_LOG, default ~/.myshell_log;
+ * set it to an empty string to turn logging off). Writers never lock:
+ * a slot is claimed with one fetch-and-add on the ring head, and each
+ * slot carries a sequence number that is odd while the slot is being
+ * written, so readers can skip torn slots. Several shells can share the
+ * same ring. The cmdlog builtin reads it back.
+ */
+
+#define CMDLOG_MAGIC 0x474f4c43u    /* "CLOG" */
+#define CMDLOG_SLOTS 4096
+#define CMDLOG_CWD 160
+#define CMDLOG_TEXT 288
+
+typedef struct cmdlog_slot_t {
+	_Atomic uint64_t seq;     /* 2*ticket+1 while writing, 2*ticket+2 done */
+	uint64_t hash;            /* FNV-1a of the full command text */
+	uint64_t start_ns, end_ns;
+	int64_t utime_us, stime_us, maxrss_kb;
+	int32_t status;
+	int32_t pid;
+	char cwd[CMDLOG_CWD];
+	char text[CMDLOG_TEXT];
+} cmdlog_slot;
+
+typedef struct cmdlog_ring_t {
+	uint32_t magic;
+	uint32_t slots;
+	_Atomic uint64_t head;    /* Next ticket to hand out */
+	uint64_t reserved[6];
+	cmdlog_slot slot[CMDLOG_SLOTS];
+} cmdlog_ring;
+
+static cmdlog_ring *ring = NULL;
+static int ring_state = 0;        /* 0 not opened yet, -1 unavailable */
+
+static uint64_t clock_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Current time in nanoseconds, for timing a command: monotonic, so a
+ * clock step doesn't change how long a command took */
+uint64_t cmdlog_now(void) {
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+/* Map the ring on first use */
+static int cmdlog_open(void) {
+	if (ring_state) {
+		return ring_state;
+	}
+	ring_state = -1;
+
+	char buf[4096];
+	const char *path = getenv("MYSHELL_LOG");
+	if (!path) {
+		const char *home = getenv("HOME");
+		if (!home) {
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%s/.myshell_log", home);
+		path = buf;
+	}
+	if (!*path) {
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(cmdlog_ring)) == -1) {
+		close(fd);
+		return -1;
+	}
+	cmdlog_ring *r = mmap(NULL, sizeof(cmdlog_ring), PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) {
+		return -1;
+	}
+	if (r->magic != CMDLOG_MAGIC || r->slots != CMDLOG_SLOTS) {
+		/* A new (zero-filled) file; racing initializers agree */
+		r->slots = CMDLOG_SLOTS;
+		r->magic = CMDLOG_MAGIC;
+	}
+	ring = r;
+	ring_state = 1;
+	return 1;
+}
+
+static uint64_t fnv1a(const char *s) {
+	uint64_t h = 14695981039346656037ull;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static void copy_truncated(char *dst, const char *src, size_t size) {
+	size_t n = strlen(src);
+	if (n >= size) {
+		n = size - 1;
+	}
+	memcpy(dst, src, n);
+	dst[n] = '\0';
+}
+
+/* Record an executed command in the ring (no-op if logging is off) */
+void cmdlog_record(const char *text, uint64_t start_ns, int status,
+		   const struct rusage *ru) {
+	if (cmdlog_open() != 1) {
+		return;
+	}
+	/* The slot keeps wall clock times, ending now and as far apart as
+	 * the monotonic clock says */
+	uint64_t took = cmdlog_now() - start_ns;
+	uint64_t end = clock_ns(CLOCK_REALTIME);
+	uint64_t ticket = atomic_fetch_add_explicit(&ring->head, 1,
+						    memory_order_relaxed);
+	cmdlog_slot *s = &ring->slot[ticket % CMDLOG_SLOTS];
+
+	atomic_store_explicit(&s->seq, 2 * ticket + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->hash = fnv1a(text);
+	s->start_ns = end - took;
+	s->end_ns = end;
+	s->status = status;
+	s->pid = getpid();
+	if (ru) {
+		s->utime_us = ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+		s->stime_us = ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+		s->maxrss_kb = ru->ru_maxrss;
+	}
+	else {
+		s->utime_us = s->stime_us = s->maxrss_kb = 0;
+	}
+	copy_truncated(s->cwd, dir_pwd(), CMDLOG_CWD);
+	copy_truncated(s->text, text, CMDLOG_TEXT);
+	atomic_store_explicit(&s->seq, 2 * ticket + 2, memory_order_release);
+}
+
+/* Copy a complete slot, returns -1 if it is being (re)written */
+static int cmdlog_read(uint64_t ticket, cmdlog_slot *out) {
+	cmdlog_slot *s = &ring->slot[ticket % CMDLOG_SLOTS];
+	uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if (seq != 2 * ticket + 2) {
+		return -1;
+	}
+	memcpy((char *)out + sizeof(s->seq), (char *)s + sizeof(s->seq),
+	       sizeof(cmdlog_slot) - sizeof(s->seq));
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&s->seq, memory_order_relaxed) == seq ?
+	       0 : -1;
+}
+
+static int compare_duration(const void *a, const void *b) {
+	const cmdlog_slot *x = a, *y = b;
+	uint64_t dx = x->end_ns - x->start_ns, dy = y->end_ns - y->start_ns;
+	return (dx < dy) - (dx > dy);
+}
+
+/**
+ * Prints the last N logged commands (default 20), oldest first.
+ * With -s, prints the N slowest of the whole ring instead.
+ */
+int execute_cmdlog(char **words) {
+	int slowest = words[1] && !strcmp(words[1], "-s");
+	char *count = words[1 + slowest];
+	long n = count ? atol(count) : 20;
+
+	if (cmdlog_open() != 1) {
+		fprintf(stderr, "cmdlog: command log is disabled\n");
+		return EXIT_FAILURE;
+	}
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t first = head > CMDLOG_SLOTS ? head - CMDLOG_SLOTS : 0;
+	if (!slowest && head - first > (uint64_t)n) {
+		first = head - n;
+	}
+
+	cmdlog_slot *copy = malloc((head - first) * sizeof(cmdlog_slot) + 1);
+	long k = 0;
+	uint64_t t;
+	for (t = first; t < head; t++) {
+		if (cmdlog_read(t, &copy[k]) == 0) {
+			k++;
+		}
+	}
+	if (slowest) {
+		qsort(copy, k, sizeof(cmdlog_slot), compare_duration);
+		if (k > n) {
+			k = n;
+		}
+	}
+
+	long i;
+	for (i = 0; i < k; i++) {
+		cmdlog_slot *s = &copy[i];
+		time_t sec = s->start_ns / 1000000000;
+		char when[32];
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sec));
+		printf("%s %10.3fms  status %-3d user %.3fs sys %.3fs "
+		       "rss %ldk  %s  %s\n",
+		       when, (s->end_ns - s->start_ns) / 1e6, s->status,
+		       s->utime_us / 1e6, s->stime_us / 1e6, (long)s->maxrss_kb,
+		       s->cwd, s->text);
+	}
+	free(copy);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,18 @@
+#ifndef __CMDLOG_H__
+#define __CMDLOG_H__
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+/* Current time in nanoseconds, for timing a command (CLOCK_MONOTONIC) */
+uint64_t cmdlog_now(void);
+
+/* Record an executed command in the ring (no-op if logging is off);
+ * start_ns is a cmdlog_now time */
+void cmdlog_record(const char *text, uint64_t start_ns, int status,
+		   const struct rusage *ru);
+
+/* Builtin: cmdlog [-s] [N] prints the last N commands (slowest with -s) */
+int execute_cmdlog(char **words);
+
+#endif
@@ -0,0 +1,709 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dag.h"
+#include "parser.h"
+#include "shell.h"
+#include "optimize.h"
+#include "expand.h"
+
+/**
+ * dag: a graph of commands, all running at once.
+ *
+ *   dag src: cat sales.csv ; east: grep east ; west: grep west ;
+ *       both: paste /dev/fd/3 /dev/fd/4 ;
+ *       src -> east west ; east -> both.3 ; west -> both.4
+ *
+ * The whole graph goes on one line. "name: command" defines a node, and
+ * the command can be any command line without a ";" outside braces.
+ * "a -> b c" connects a's stdout to the stdin of b and of c. "a b -> c"
+ * feeds both a and b into c, and "a -> b -> c" is a chain. "name.N"
+ * picks another descriptor, 0 to 9: "a.2 -> log" sends a's stderr, and
+ * "a -> b.3" arrives on b's fd 3.
+ *
+ * When several nodes read one output, a relay copies it to each of them
+ * (fan-out), and a reader that stops doesn't stop the others. When
+ * several outputs go into one input, a relay merges them a whole line at
+ * a time (fan-in). Descriptors left unconnected are the shell's own. A
+ * graph with a cycle is refused.
+ *
+ * Every node and relay is forked before any of them is waited for, in
+ * one process group, and they are reaped through pidfds as they exit.
+ * Each child closes the pipes it doesn't use, so a reader sees EOF as
+ * soon as its writers are done. PIPESTATUS holds the nodes' statuses in
+ * the order they were defined. $? is 0 if all of them succeeded, or else
+ * the status of the last one in that order that failed.
+ */
+
+#define MAX_NODES 32
+#define MAX_EDGES 64
+#define MAX_GRAPH_FDS (4 * MAX_EDGES)
+#define MAX_CHAIN 128            /* Names in one line of edges */
+#define NODE_FDS 10              /* Descriptors 0 to 9 can be connected */
+#define DAG_FD_BASE 64           /* Above any descriptor a node is given */
+#define RELAY_BUF (64 * 1024)
+
+typedef struct node {
+	char *name;
+	command *cmd;
+	int map[NODE_FDS];       /* Pipe end to give it as each fd, or -1 */
+	pid_t pid;               /* 0 when not running */
+	int pidfd;
+	int status;
+} node;
+
+/* One end of an edge */
+typedef struct endpoint {
+	char *name;
+	int node, fd;
+} endpoint;
+
+typedef struct edge {
+	endpoint from, to;
+	int pipe[2];
+} edge;
+
+/* Copies one input to every output (fan-out), or merges every input
+ * into one output (fan-in) */
+typedef struct relay {
+	int merge;
+	int in[MAX_EDGES], nin;
+	int out[MAX_EDGES], nout;
+	pid_t pid;
+	int pidfd;
+} relay;
+
+typedef struct graph {
+	node nodes[MAX_NODES];
+	int nnodes;
+	edge edges[MAX_EDGES];
+	int nedges;
+	relay relays[MAX_EDGES];
+	int nrelays;
+	int fds[MAX_GRAPH_FDS];  /* Every pipe end the shell holds */
+	int nfds;
+} graph;
+
+static int find_node(graph *g, const char *name) {
+	int i;
+	for (i = 0; i < g->nnodes; i++) {
+		if (!strcmp(g->nodes[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int valid_name(const char *name, size_t len) {
+	size_t i;
+	if (!len || isdigit((unsigned char)name[0])) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* "name: command ..." */
+static int add_node(graph *g, char **tokens) {
+	size_t len = strlen(tokens[0]) - 1;
+	tokens[0][len] = '\0';
+	if (!valid_name(tokens[0], len)) {
+		fprintf(stderr, "dag: bad node name '%s'\n", tokens[0]);
+		return -1;
+	}
+	if (find_node(g, tokens[0]) != -1) {
+		fprintf(stderr, "dag: node '%s' defined twice\n", tokens[0]);
+		return -1;
+	}
+	if (g->nnodes == MAX_NODES) {
+		fprintf(stderr, "dag: more than %d nodes\n", MAX_NODES);
+		return -1;
+	}
+	if (!tokens[1]) {
+		fprintf(stderr, "dag: node '%s' has no command\n", tokens[0]);
+		return -1;
+	}
+	command *cmd = construct_command(tokens + 1);
+	if (!cmd) {
+		return -1;
+	}
+	node *n = &g->nodes[g->nnodes++];
+	n->name = tokens[0];
+	n->cmd = optimize_command(cmd);
+	return 0;
+}
+
+/* "name" or "name.N"; fd is -1 unless given */
+static int parse_endpoint(char *token, endpoint *ep) {
+	char *dot = strrchr(token, '.');
+	ep->fd = -1;
+	if (dot && isdigit((unsigned char)dot[1]) && !dot[2]) {
+		ep->fd = dot[1] - '0';
+		*dot = '\0';
+	}
+	if (!valid_name(token, strlen(token))) {
+		fprintf(stderr, "dag: bad node name '%s'\n", token);
+		return -1;
+	}
+	ep->name = token;
+	return 0;
+}
+
+/* "a b -> c -> d e": every node of a group feeds every node of the next */
+static int add_edges(graph *g, char **tokens) {
+	endpoint eps[MAX_CHAIN];
+	int group[MAX_CHAIN];    /* Which group each endpoint is in */
+	int n = 0, groups = 0, i, j;
+
+	for (i = 0; tokens[i]; i++) {
+		if (!strcmp(tokens[i], "->")) {
+			if (!n || group[n - 1] != groups) {
+				break;
+			}
+			groups++;
+			continue;
+		}
+		if (n == MAX_CHAIN) {
+			break;
+		}
+		if (parse_endpoint(tokens[i], &eps[n]) == -1) {
+			return -1;
+		}
+		group[n++] = groups;
+	}
+	if (tokens[i] || !groups || group[n - 1] != groups) {
+		fprintf(stderr, "dag: an edge needs nodes on both sides of ->\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = i + 1; j < n; j++) {
+			if (group[j] != group[i] + 1) {
+				continue;
+			}
+			if (g->nedges == MAX_EDGES) {
+				fprintf(stderr, "dag: more than %d edges\n", MAX_EDGES);
+				return -1;
+			}
+			edge *e = &g->edges[g->nedges++];
+			e->from = eps[i];
+			e->to = eps[j];
+			e->from.fd = eps[i].fd == -1 ? STDOUT_FILENO : eps[i].fd;
+			e->to.fd = eps[j].fd == -1 ? STDIN_FILENO : eps[j].fd;
+		}
+	}
+	return 0;
+}
+
+/* Split the words after "dag" at the ";"s outside braces and parentheses
+ * and read each part as a node or a line of edges */
+static int parse_graph(graph *g, char **tokens) {
+	int start = 1, depth = 0, i;
+
+	for (i = 1; ; i++) {
+		if (tokens[i] && (!strcmp(tokens[i], "{") || !strcmp(tokens[i], "("))) {
+			depth++;
+		}
+		else if (tokens[i] && (!strcmp(tokens[i], "}") ||
+				       !strcmp(tokens[i], ")"))) {
+			depth--;
+		}
+		if (tokens[i] && (depth || strcmp(tokens[i], ";"))) {
+			continue;
+		}
+
+		/* tokens[start..i) is one part */
+		int end = !tokens[i];
+		tokens[i] = NULL;
+		if (i > start) {
+			size_t len = strlen(tokens[start]);
+			int status = len > 1 && tokens[start][len - 1] == ':' ?
+				     add_node(g, tokens + start) :
+				     add_edges(g, tokens + start);
+			if (status == -1) {
+				return -1;
+			}
+		}
+		if (end) {
+			break;
+		}
+		start = i + 1;
+	}
+	if (!g->nnodes) {
+		fprintf(stderr, "usage: dag name: command ; ... ; "
+			"name[.fd] -> name[.fd] ...\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Resolve the edges' names and refuse what can't run */
+static int check_graph(graph *g) {
+	int role[MAX_NODES][NODE_FDS];   /* 1 read by the node, 2 written */
+	int indegree[MAX_NODES], queue[MAX_NODES];
+	int i, j, head = 0, tail = 0;
+
+	memset(role, 0, sizeof(role));
+	for (i = 0; i < g->nedges; i++) {
+		edge *e = &g->edges[i];
+		endpoint *ends[2] = { &e->from, &e->to };
+		for (j = 0; j < 2; j++) {
+			ends[j]->node = find_node(g, ends[j]->name);
+			if (ends[j]->node == -1) {
+				fprintf(stderr, "dag: no node named '%s'\n",
+					ends[j]->name);
+				return -1;
+			}
+			int *r = &role[ends[j]->node][ends[j]->fd];
+			if (*r && *r != 2 - j) {
+				fprintf(stderr, "dag: %s.%d is both read and "
+					"written\n", ends[j]->name, ends[j]->fd);
+				return -1;
+			}
+			*r = 2 - j;
+		}
+		for (j = 0; j < i; j++) {
+			edge *d = &g->edges[j];
+			if (d->from.node == e->from.node && d->from.fd == e->from.fd &&
+			    d->to.node == e->to.node && d->to.fd == e->to.fd) {
+				fprintf(stderr, "dag: edge %s -> %s given twice\n",
+					e->from.name, e->to.name);
+				return -1;
+			}
+		}
+	}
+
+	/* Take away nodes nothing feeds until none are left, or only a
+	 * cycle is */
+	memset(indegree, 0, sizeof(indegree));
+	for (i = 0; i < g->nedges; i++) {
+		indegree[g->edges[i].to.node]++;
+	}
+	for (i = 0; i < g->nnodes; i++) {
+		if (!indegree[i]) {
+			queue[tail++] = i;
+		}
+	}
+	while (head < tail) {
+		int n = queue[head++];
+		for (i = 0; i < g->nedges; i++) {
+			if (g->edges[i].from.node == n &&
+			    !--indegree[g->edges[i].to.node]) {
+				queue[tail++] = g->edges[i].to.node;
+			}
+		}
+	}
+	for (i = 0; tail < g->nnodes && i < g->nnodes; i++) {
+		if (indegree[i]) {
+			fprintf(stderr, "dag: cycle through '%s'\n",
+				g->nodes[i].name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int graph_pipe(graph *g, int fds[2]) {
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	g->fds[g->nfds++] = fds[0];
+	g->fds[g->nfds++] = fds[1];
+	return 0;
+}
+
+/* Give every node's descriptors their pipe ends, putting a relay in
+ * front of any end with more than one edge */
+static int plumb_graph(graph *g) {
+	int i, j, fd, dir;
+
+	for (i = 0; i < g->nedges; i++) {
+		if (graph_pipe(g, g->edges[i].pipe) == -1) {
+			return -1;
+		}
+	}
+	for (i = 0; i < g->nnodes; i++) {
+		for (fd = 0; fd < NODE_FDS; fd++) {
+			g->nodes[i].map[fd] = -1;
+		}
+	}
+
+	for (i = 0; i < g->nnodes; i++) {
+		for (fd = 0; fd < NODE_FDS; fd++) {
+			/* dir 0: what the node writes, 1: what it reads */
+			for (dir = 0; dir < 2; dir++) {
+				int ends[MAX_EDGES], n = 0;
+				for (j = 0; j < g->nedges; j++) {
+					endpoint *ep = dir ? &g->edges[j].to :
+						       &g->edges[j].from;
+					if (ep->node == i && ep->fd == fd) {
+						ends[n++] = g->edges[j].pipe[dir ? 0 : 1];
+					}
+				}
+				if (n == 1) {
+					g->nodes[i].map[fd] = ends[0];
+				}
+				if (n < 2) {
+					continue;
+				}
+
+				int pfd[2];
+				if (graph_pipe(g, pfd) == -1) {
+					return -1;
+				}
+				relay *r = &g->relays[g->nrelays++];
+				r->merge = dir;
+				if (dir) {
+					memcpy(r->in, ends, n * sizeof(int));
+					r->nin = n;
+					r->out[r->nout++] = pfd[1];
+					g->nodes[i].map[fd] = pfd[0];
+				}
+				else {
+					r->in[r->nin++] = pfd[0];
+					memcpy(r->out, ends, n * sizeof(int));
+					r->nout = n;
+					g->nodes[i].map[fd] = pfd[1];
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Fan-out: every output gets all of the input, until its reader goes */
+static void copy_relay(relay *r) {
+	char *buf = malloc(RELAY_BUF);
+	int live = r->nout, i;
+	ssize_t len;
+
+	while (live && (len = read(r->in[0], buf, RELAY_BUF)) != 0) {
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("dag: read");
+			break;
+		}
+		for (i = 0; i < r->nout; i++) {
+			if (r->out[i] != -1 && write_all(r->out[i], buf, len) == -1) {
+				close(r->out[i]);
+				r->out[i] = -1;
+				live--;
+			}
+		}
+	}
+	_exit(0);
+}
+
+/* Fan-in: whole lines from every input, in the order they complete */
+static void merge_relay(relay *r) {
+	struct pollfd pfds[MAX_EDGES];
+	char *buf[MAX_EDGES];
+	size_t len[MAX_EDGES], cap[MAX_EDGES];
+	int slot[MAX_EDGES];
+	int i, live = r->nin;
+
+	for (i = 0; i < r->nin; i++) {
+		cap[i] = RELAY_BUF;
+		buf[i] = malloc(cap[i]);
+		len[i] = 0;
+	}
+	while (live) {
+		int n = 0;
+		for (i = 0; i < r->nin; i++) {
+			if (r->in[i] != -1) {
+				pfds[n].fd = r->in[i];
+				pfds[n].events = POLLIN;
+				slot[n++] = i;
+			}
+		}
+		if (poll(pfds, n, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("dag: poll");
+			break;
+		}
+		for (n--; n >= 0; n--) {
+			if (!pfds[n].revents) {
+				continue;
+			}
+			i = slot[n];
+			if (len[i] == cap[i]) {
+				cap[i] *= 2;
+				buf[i] = realloc(buf[i], cap[i]);
+			}
+			ssize_t got = read(r->in[i], buf[i] + len[i], cap[i] - len[i]);
+			if (got == -1 && errno == EINTR) {
+				continue;
+			}
+			if (got <= 0) {
+				/* Its last line may have no newline */
+				if (write_all(r->out[0], buf[i], len[i]) == -1) {
+					_exit(0);
+				}
+				len[i] = 0;
+				close(r->in[i]);
+				r->in[i] = -1;
+				live--;
+				continue;
+			}
+			len[i] += got;
+			char *nl = memrchr(buf[i], '\n', len[i]);
+			if (!nl) {
+				continue;
+			}
+			size_t whole = nl - buf[i] + 1;
+			if (write_all(r->out[0], buf[i], whole) == -1) {
+				_exit(0);
+			}
+			memmove(buf[i], buf[i] + whole, len[i] - whole);
+			len[i] -= whole;
+		}
+	}
+	_exit(0);
+}
+
+/* In a child: close every pipe of the graph but the ones in keep */
+static void close_graph(graph *g, const int *keep, int nkeep) {
+	int i, j;
+	for (i = 0; i < g->nfds; i++) {
+		for (j = 0; j < nkeep && keep[j] != g->fds[i]; j++)
+			;
+		if (j == nkeep) {
+			close(g->fds[i]);
+		}
+	}
+}
+
+/* In a node's child: move its pipe ends onto its descriptors. They go
+ * above DAG_FD_BASE first, so none is overwritten before it is moved. */
+static void node_descriptors(graph *g, node *n) {
+	int moved[NODE_FDS], fd;
+	for (fd = 0; fd < NODE_FDS; fd++) {
+		moved[fd] = n->map[fd] == -1 ? -1 :
+			    fcntl(n->map[fd], F_DUPFD_CLOEXEC, DAG_FD_BASE);
+	}
+	close_graph(g, NULL, 0);
+	for (fd = 0; fd < NODE_FDS; fd++) {
+		if (moved[fd] != -1) {
+			dup2(moved[fd], fd);
+			close(moved[fd]);
+		}
+	}
+}
+
+/* Fork a node (r NULL) or relay into the graph's process group */
+static pid_t spawn(graph *g, node *n, relay *r, pid_t *pgid, int group) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (group) {
+			setpgid(0, *pgid);
+			signal(SIGTTOU, SIG_DFL);
+		}
+		if (r) {
+			int keep[2 * MAX_EDGES];
+			memcpy(keep, r->in, r->nin * sizeof(int));
+			memcpy(keep + r->nin, r->out, r->nout * sizeof(int));
+			close_graph(g, keep, r->nin + r->nout);
+			signal(SIGPIPE, SIG_IGN);
+			r->merge ? merge_relay(r) : copy_relay(r);
+		}
+		node_descriptors(g, n);
+		execute_complex_command(n->cmd);
+		exit(0);
+	}
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (group) {
+		/* Set the group from both sides, whichever runs first */
+		if (!*pgid) {
+			*pgid = pid;
+			setpgid(pid, pid);
+			if (shell_interactive) {
+				tcsetpgrp(STDIN_FILENO, pid);
+			}
+		}
+		else {
+			setpgid(pid, *pgid);
+		}
+	}
+	return pid;
+}
+
+/* Reap a node or relay if it exited (or, blocking, when it does);
+ * returns 1 once it is reaped */
+static int reap(pid_t *pid, int *pidfd, int *status, int block) {
+	int ws;
+	if (*pid <= 0 || waitpid(*pid, &ws, block ? 0 : WNOHANG) != *pid) {
+		return 0;
+	}
+	*pid = 0;
+	if (*pidfd != -1) {
+		close(*pidfd);
+		*pidfd = -1;
+	}
+	*status = WIFSIGNALED(ws) ? 128 + WTERMSIG(ws) : WEXITSTATUS(ws);
+	return 1;
+}
+
+/* Wait for every node and relay, as they exit */
+static void reap_graph(graph *g) {
+	struct pollfd pfds[MAX_NODES + MAX_EDGES];
+	int i, left, ignored;
+
+	do {
+		left = 0;
+		for (i = 0; i < g->nnodes; i++) {
+			if (g->nodes[i].pidfd != -1) {
+				pfds[left].fd = g->nodes[i].pidfd;
+				pfds[left++].events = POLLIN;
+			}
+		}
+		for (i = 0; i < g->nrelays; i++) {
+			if (g->relays[i].pidfd != -1) {
+				pfds[left].fd = g->relays[i].pidfd;
+				pfds[left++].events = POLLIN;
+			}
+		}
+		if (left && poll(pfds, left, -1) == -1 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < g->nnodes; i++) {
+			node *n = &g->nodes[i];
+			if (n->pidfd != -1) {
+				reap(&n->pid, &n->pidfd, &n->status, 0);
+			}
+		}
+		for (i = 0; i < g->nrelays; i++) {
+			relay *r = &g->relays[i];
+			if (r->pidfd != -1) {
+				reap(&r->pid, &r->pidfd, &ignored, 0);
+			}
+		}
+	} while (left);
+
+	/* Without pidfds, wait in order */
+	for (i = 0; i < g->nnodes; i++) {
+		reap(&g->nodes[i].pid, &g->nodes[i].pidfd, &g->nodes[i].status, 1);
+	}
+	for (i = 0; i < g->nrelays; i++) {
+		reap(&g->relays[i].pid, &g->relays[i].pidfd, &ignored, 1);
+	}
+}
+
+/* Start everything, then wait for all of it; returns $? */
+static int run_graph(graph *g) {
+	int i, started = 1, group = getpid() == shell_pid;
+	pid_t pgid = 0;
+
+	fflush(stdout);
+	for (i = 0; i < g->nnodes + g->nrelays; i++) {
+		node *n = i < g->nnodes ? &g->nodes[i] : NULL;
+		relay *r = n ? NULL : &g->relays[i - g->nnodes];
+		pid_t *pid = n ? &n->pid : &r->pid;
+		int *pidfd = n ? &n->pidfd : &r->pidfd;
+
+		*pid = spawn(g, n, r, &pgid, group);
+		if (*pid == -1) {
+			*pid = 0;
+			started = 0;
+			break;
+		}
+		*pidfd = syscall(SYS_pidfd_open, *pid, 0);
+	}
+	for (i = 0; i < g->nfds; i++) {
+		close(g->fds[i]);
+	}
+	reap_graph(g);
+	if (group && pgid && shell_interactive) {
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	}
+
+	int statuses[MAX_NODES], status = 0;
+	for (i = 0; i < g->nnodes; i++) {
+		statuses[i] = g->nodes[i].status;
+		if (statuses[i]) {
+			status = statuses[i];
+		}
+	}
+	if (!started) {
+		status = EXIT_FAILURE;
+	}
+	set_status(status, statuses, g->nnodes);
+	return status;
+}
+
+/* Keyword: dag name: command ; ... ; name[.fd] -> name[.fd] ... ; ...
+ * Sets $? and PIPESTATUS, and returns $? */
+int execute_dag(char **tokens) {
+	graph *g = calloc(1, sizeof(graph));
+	int i, ran = 0, status = EXIT_FAILURE;
+
+	if (!g) {
+		perror("dag");
+		set_status(status, &status, 1);
+		return status;
+	}
+	for (i = 0; i < MAX_NODES; i++) {
+		g->nodes[i].pidfd = -1;
+	}
+	for (i = 0; i < MAX_EDGES; i++) {
+		g->relays[i].pidfd = -1;
+	}
+	if (parse_graph(g, tokens) == 0 && check_graph(g) == 0) {
+		if (plumb_graph(g) == 0) {
+			status = run_graph(g);
+			ran = 1;
+		}
+		else {
+			for (i = 0; i < g->nfds; i++) {
+				close(g->fds[i]);
+			}
+		}
+	}
+	if (!ran) {
+		/* run_graph sets PIPESTATUS itself */
+		set_status(status, &status, 1);
+	}
+	for (i = 0; i < g->nnodes; i++) {
+		release_command(g->nodes[i].cmd);
+	}
+	free(g);
+	return status;
+}
@@ -0,0 +1,9 @@
+#ifndef __DAG_H__
+#define __DAG_H__
+
+/* Keyword: dag name: command ; ... ; name[.fd] -> name[.fd] ... ; ...
+ * Runs a graph of commands connected by pipes, all at once. Sets $? and
+ * PIPESTATUS, and returns $? */
+int execute_dag(char **tokens);
+
+#endif
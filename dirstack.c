@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "dirstack.h"
+
+/**
+ * Directory changes, the directory stack (pushd/popd/dirs) and CDPATH.
+ *
+ * The shell keeps a logical working directory, so cd never needs getcwd
+ * and paths are not limited in length. Targets are normalized lexically
+ * (like cd -L) and entered with a single chdir. There is no cache of
+ * directory descriptors: checking that one still matches its path takes
+ * the same walk from the root as the chdir it would save.
+ */
+
+static char *pwd = NULL, *oldpwd = NULL;
+
+static char **dir_stack = NULL;   /* pushd'ed directories, top is last */
+static int dir_depth = 0, dir_cap = 0;
+
+/* Join path to base (unless absolute) and resolve ".", ".." and "//" */
+static char *join_normalize(const char *base, const char *path) {
+	size_t n = strlen(base) + strlen(path) + 2;
+	char *src = malloc(n), *out = malloc(n + 1);
+	snprintf(src, n, "%s/%s", path[0] == '/' ? "" : base, path);
+
+	size_t len = 0;
+	char *save, *comp;
+	for (comp = strtok_r(src, "/", &save); comp;
+	     comp = strtok_r(NULL, "/", &save)) {
+		if (!strcmp(comp, ".")) {
+			continue;
+		}
+		if (!strcmp(comp, "..")) {
+			while (len > 0 && out[len-1] != '/') {
+				len--;
+			}
+			if (len > 0) {
+				len--;
+			}
+			continue;
+		}
+		out[len++] = '/';
+		strcpy(out + len, comp);
+		len += strlen(comp);
+	}
+	if (len == 0) {
+		out[len++] = '/';
+	}
+	out[len] = '\0';
+	free(src);
+	return out;
+}
+
+/* Logical current working directory (no getcwd call, no length limit) */
+const char *dir_pwd(void) {
+	if (!pwd) {
+		/* Trust $PWD if it still names the current directory */
+		const char *env = getenv("PWD");
+		struct stat a, b;
+		if (env && env[0] == '/' && stat(env, &a) == 0 &&
+		    stat(".", &b) == 0 && a.st_dev == b.st_dev &&
+		    a.st_ino == b.st_ino) {
+			pwd = strdup(env);
+		}
+		else {
+			pwd = getcwd(NULL, 0);
+		}
+		if (!pwd) {
+			pwd = strdup(".");
+		}
+	}
+	return pwd;
+}
+
+static void set_pwd(char *path) {
+	dir_pwd();
+	free(oldpwd);
+	oldpwd = pwd;
+	pwd = path;
+	setenv("OLDPWD", oldpwd, 1);
+	setenv("PWD", pwd, 1);
+}
+
+/* Determine if a relative path explicitly starts at "." or ".." */
+static int is_dot_relative(const char *path) {
+	return !strcmp(path, ".") || !strcmp(path, "..") ||
+	       !strncmp(path, "./", 2) || !strncmp(path, "../", 3);
+}
+
+/* Try each CDPATH entry in turn, returns 0 if one matched */
+static int cdpath_change(const char *path) {
+	const char *cdpath = getenv("CDPATH");
+	if (!cdpath) {
+		return -1;
+	}
+	char *list = strdup(cdpath), *entry = list, *next;
+	int found = -1;
+	do {
+		next = strchr(entry, ':');
+		if (next) {
+			*next++ = '\0';
+		}
+		char *base = join_normalize(dir_pwd(), *entry ? entry : ".");
+		char *target = join_normalize(base, path);
+		free(base);
+		if (chdir(target) == 0) {
+			/* Show where we ended up, as other shells do */
+			if (*entry) {
+				printf("%s\n", target);
+			}
+			set_pwd(target);
+			found = 0;
+			break;
+		}
+		free(target);
+	} while ((entry = next));
+	free(list);
+	return found;
+}
+
+/* Change to a directory, looking it up in CDPATH if relative.
+ * Returns 0, or -1 with errno set. */
+int dir_change(const char *path) {
+	if (path[0] != '/' && !is_dot_relative(path) &&
+	    cdpath_change(path) == 0) {
+		return 0;
+	}
+
+	char *target = join_normalize(dir_pwd(), path);
+	if (chdir(target) == 0) {
+		set_pwd(target);
+		return 0;
+	}
+	free(target);
+
+	/* The lexical path may not exist (e.g. ".." out of a symlink that
+	 * was removed); fall back to the kernel's view */
+	if (chdir(path) == -1) {
+		return -1;
+	}
+	target = getcwd(NULL, 0);
+	set_pwd(target ? target : strdup(path));
+	return 0;
+}
+
+/* Previous directory, for cd - */
+const char *dir_oldpwd(void) {
+	return oldpwd ? oldpwd : getenv("OLDPWD");
+}
+
+static void print_stack(int verbose) {
+	int i, n = 0;
+	if (verbose) {
+		printf("%2d  %s\n", n++, dir_pwd());
+	}
+	else {
+		printf("%s", dir_pwd());
+	}
+	for (i = dir_depth - 1; i >= 0; i--) {
+		if (verbose) {
+			printf("%2d  %s\n", n++, dir_stack[i]);
+		}
+		else {
+			printf(" %s", dir_stack[i]);
+		}
+	}
+	if (!verbose) {
+		printf("\n");
+	}
+}
+
+/**
+ * Pushes the current directory on the stack and changes to words[1].
+ * Without an argument, exchanges the current directory with the top.
+ */
+int execute_pushd(char **words) {
+	char *prev = strdup(dir_pwd());
+
+	if (!words[1]) {
+		if (!dir_depth) {
+			fprintf(stderr, "pushd: no other directory\n");
+			free(prev);
+			return EXIT_FAILURE;
+		}
+		char *top = dir_stack[dir_depth-1];
+		if (dir_change(top) == -1) {
+			perror(top);
+			free(prev);
+			return EXIT_FAILURE;
+		}
+		free(top);
+		dir_stack[dir_depth-1] = prev;
+	}
+	else {
+		if (dir_change(words[1]) == -1) {
+			perror(words[1]);
+			free(prev);
+			return EXIT_FAILURE;
+		}
+		if (dir_depth == dir_cap) {
+			dir_cap = dir_cap ? dir_cap * 2 : 8;
+			dir_stack = realloc(dir_stack, dir_cap * sizeof(char *));
+		}
+		dir_stack[dir_depth++] = prev;
+	}
+	print_stack(0);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Pops the top of the directory stack and changes to it.
+ */
+int execute_popd(char **words) {
+	if (!dir_depth) {
+		fprintf(stderr, "popd: directory stack empty\n");
+		return EXIT_FAILURE;
+	}
+	char *top = dir_stack[--dir_depth];
+	if (dir_change(top) == -1) {
+		perror(top);
+		dir_depth++;
+		return EXIT_FAILURE;
+	}
+	free(top);
+	print_stack(0);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Prints the directory stack: "dirs" on one line, "dirs -v" numbered,
+ * "dirs -c" clears it.
+ */
+int execute_dirs(char **words) {
+	if (words[1] && !strcmp(words[1], "-c")) {
+		while (dir_depth > 0) {
+			free(dir_stack[--dir_depth]);
+		}
+		return EXIT_SUCCESS;
+	}
+	print_stack(words[1] && !strcmp(words[1], "-v"));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef __DIRSTACK_H__
+#define __DIRSTACK_H__
+
+/* Logical current working directory (no getcwd call, no length limit) */
+const char *dir_pwd(void);
+
+/* Previous directory, for cd - */
+const char *dir_oldpwd(void);
+
+/* Change to a directory, looking it up in CDPATH if relative.
+ * Returns 0, or -1 with errno set. */
+int dir_change(const char *path);
+
+/* Builtins: pushd, popd, dirs */
+int execute_pushd(char **words);
+int execute_popd(char **words);
+int execute_dirs(char **words);
+
+#endif
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "expand.h"
+#include "parser.h"
+#include "shell.h"
+
+/**
+ * Word expansion: command substitution, $(cmd) and `cmd`, the
+ * positional parameters of a function ($0-$9, $#, $@, $*), and the
+ * statuses of the last command ($?, $PIPESTATUS, ${PIPESTATUS[n]},
+ * ${PIPESTATUS[@]}).
+ *
+ * The inner command runs in a child whose stdout is a pipe. Small outputs
+ * are read straight into a growable buffer; once the output outgrows
+ * CAPTURE_SPLICE_THRESHOLD the rest is spliced into a memfd that is then
+ * mapped, so big outputs never pass through a user-space copy loop.
+ * Field splitting writes NUL bytes into the captured data and the words
+ * point directly into it.
+ */
+
+#define CAPTURE_CHUNK (64 * 1024)
+#define CAPTURE_SPLICE_THRESHOLD (1024 * 1024)
+
+static int is_ifs(char c) {
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* Determine if a word needs expansion */
+int needs_expansion(const char *word) {
+	return strpbrk(word, "$`") != NULL;
+}
+
+static void push_word(expansion *e, char *word) {
+	if (e->argc + 1 >= e->cap) {
+		e->cap = e->cap ? e->cap * 2 : 16;
+		e->argv = realloc(e->argv, e->cap * sizeof(char *));
+	}
+	e->argv[e->argc++] = word;
+	e->argv[e->argc] = NULL;
+}
+
+static char *keep_string(expansion *e, char *s) {
+	e->strings = realloc(e->strings, (e->nstrings + 1) * sizeof(char *));
+	e->strings[e->nstrings++] = s;
+	return s;
+}
+
+/* Move whatever is left in the pipe into a mapped memfd */
+static int capture_splice(capture *c, int fd, char *buf, size_t size) {
+	int memfd = memfd_create("capture", MFD_CLOEXEC);
+	if (memfd == -1) {
+		return -1;
+	}
+	size_t off = 0;
+	while (off < size) {
+		ssize_t n = write(memfd, buf + off, size - off);
+		if (n == -1) {
+			close(memfd);
+			return -1;
+		}
+		off += n;
+	}
+	ssize_t n;
+	while ((n = splice(fd, NULL, memfd, NULL, CAPTURE_SPLICE_THRESHOLD,
+			   SPLICE_F_MOVE)) > 0) {
+		size += n;
+	}
+	if (n == -1 || ftruncate(memfd, size + 1) == -1) {
+		close(memfd);
+		return -1;
+	}
+	char *data = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  memfd, 0);
+	close(memfd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	data[size] = '\0';
+	c->data = data;
+	c->size = size;
+	c->mapped = size + 1;
+	return 0;
+}
+
+/* Run a command line and capture its standard output */
+capture *capture_output(const char *text, size_t len) {
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return NULL;
+	}
+
+	/* Don't let the child flush our pending output into the pipe */
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(pfd[0]);
+		close(pfd[1]);
+		return NULL;
+	}
+	if (pid == 0) {
+		if (dup2(pfd[1], STDOUT_FILENO) == -1) {
+			perror("dup2");
+			exit(1);
+		}
+		char *line = strndup(text, len);
+		run_line(line, 1);
+		exit(0);
+	}
+	close(pfd[1]);
+
+	capture *c = calloc(1, sizeof(capture));
+	size_t cap = CAPTURE_CHUNK, size = 0;
+	char *buf = malloc(cap + 1);
+	ssize_t n;
+	while ((n = read(pfd[0], buf + size, cap - size)) > 0 ||
+	       (n == -1 && errno == EINTR)) {
+		if (n == -1) {
+			continue;
+		}
+		size += n;
+		if (size < cap) {
+			continue;
+		}
+		if (cap >= CAPTURE_SPLICE_THRESHOLD &&
+		    capture_splice(c, pfd[0], buf, size) == 0) {
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		cap *= 2;
+		buf = realloc(buf, cap + 1);
+	}
+	if (buf) {
+		buf[size] = '\0';
+		c->data = buf;
+		c->size = size;
+	}
+	close(pfd[0]);
+
+	if (waitpid(pid, NULL, 0) == -1) {
+		perror("waitpid");
+	}
+	return c;
+}
+
+/* Find the end of the substitution starting at p, and its inner text */
+static char *substitution_end(char *p, char **inner, size_t *len) {
+	char *end;
+	*inner = p + 1;
+	if (*p == '`') {
+		end = strchr(p + 1, '`');
+		*len = end ? (size_t)(end - *inner) : strlen(*inner);
+		return *inner + *len + (end != NULL);
+	}
+	*inner = p + 2;
+	end = skip_substitution(p + 1);
+	*len = end - *inner;
+	if (*len > 0 && end[-1] == ')') {
+		(*len)--;
+	}
+	return end;
+}
+
+static int is_substitution(const char *p) {
+	return *p == '`' || (p[0] == '$' && p[1] == '(');
+}
+
+static capture *substitute(char *p, char **end, expansion *e) {
+	char *inner;
+	size_t len;
+	*end = substitution_end(p, &inner, &len);
+	capture *c = capture_output(inner, len);
+	if (c) {
+		c->next = e->captures;
+		e->captures = c;
+	}
+	return c;
+}
+
+/* Positional parameters: $0 is the function name, then its arguments */
+static char **positional = NULL;
+
+/* Replace the positional parameters, returns the previous ones */
+char **set_positional(char **argv) {
+	char **old = positional;
+	positional = argv;
+	return old;
+}
+
+/* $? and PIPESTATUS: the statuses of the last command's stages */
+static int status_last;
+static int pipestatus[MAX_PIPESTATUS];
+static int npipestatus = 1;
+
+/* Set $? and the PIPESTATUS array after a command has run */
+void set_status(int status, const int *stages, int n) {
+	status_last = status;
+	npipestatus = n < MAX_PIPESTATUS ? n : MAX_PIPESTATUS;
+	memcpy(pipestatus, stages, npipestatus * sizeof(int));
+}
+
+/* The value of $? */
+int last_status(void) {
+	return status_last;
+}
+
+/* $!: the pid of the last background job */
+static pid_t job_last;
+
+void set_last_job(pid_t pid) {
+	job_last = pid;
+}
+
+/* Length of the parameter reference at p, 0 if there is none */
+static size_t parameter_length(const char *p) {
+	if (p[0] != '$' || !p[1]) {
+		return 0;
+	}
+	if (isdigit((unsigned char)p[1]) || strchr("#@*?!", p[1])) {
+		return 2;
+	}
+	if (!strncmp(p + 1, "PIPESTATUS", 10)) {
+		return 11;
+	}
+	if (!strncmp(p + 1, "{PIPESTATUS[", 12)) {
+		const char *end = strstr(p, "]}");
+		return end ? end + 2 - p : 0;
+	}
+	return 0;
+}
+
+static int positional_count(void) {
+	int n = 0;
+	while (positional && positional[n]) {
+		n++;
+	}
+	return n;
+}
+
+/* Growable string used when a word mixes literals and substitutions */
+typedef struct strbuf_t {
+	char *s;
+	size_t len, cap;
+} strbuf;
+
+static void sb_append(strbuf *b, const char *s, size_t n) {
+	if (b->len + n + 1 > b->cap) {
+		b->cap = (b->len + n + 1) * 2;
+		b->s = realloc(b->s, b->cap);
+	}
+	memcpy(b->s + b->len, s, n);
+	b->len += n;
+	b->s[b->len] = '\0';
+}
+
+static void sb_flush(strbuf *b, expansion *e) {
+	if (b->s) {
+		push_word(e, keep_string(e, b->s));
+	}
+	b->s = NULL;
+	b->len = b->cap = 0;
+}
+
+/* Append the PIPESTATUS element named by index ("@", "*" or a number),
+ * every element making a field of its own */
+static void expand_pipestatus(const char *index, strbuf *cur, expansion *e,
+			      int split) {
+	char num[16];
+	int i, first = 0, last = npipestatus;
+
+	if (*index != '@' && *index != '*') {
+		first = atoi(index);
+		last = first + 1;
+	}
+	for (i = first; i >= 0 && i < last && i < npipestatus; i++) {
+		if (i > first) {
+			if (split) {
+				sb_flush(cur, e);
+			}
+			else {
+				sb_append(cur, " ", 1);
+			}
+		}
+		snprintf(num, sizeof(num), "%d", pipestatus[i]);
+		sb_append(cur, num, strlen(num));
+	}
+}
+
+/* Append the value of the parameter at p; "$@" and "$*" make one field
+ * per argument */
+static void expand_parameter(const char *p, strbuf *cur, expansion *e,
+			     int split) {
+	int n = positional_count(), i;
+	char num[16], c = p[1];
+
+	if (c == 'P') {
+		expand_pipestatus("0", cur, e, split);
+		return;
+	}
+	if (c == '{') {
+		expand_pipestatus(p + 13, cur, e, split);
+		return;
+	}
+	if (c == '?') {
+		snprintf(num, sizeof(num), "%d", status_last);
+		sb_append(cur, num, strlen(num));
+		return;
+	}
+	if (c == '!') {
+		if (job_last) {
+			snprintf(num, sizeof(num), "%d", (int)job_last);
+			sb_append(cur, num, strlen(num));
+		}
+		return;
+	}
+	if (isdigit((unsigned char)c)) {
+		i = c - '0';
+		if (i < n) {
+			sb_append(cur, positional[i], strlen(positional[i]));
+		}
+		return;
+	}
+	if (c == '#') {
+		snprintf(num, sizeof(num), "%d", n > 0 ? n - 1 : 0);
+		sb_append(cur, num, strlen(num));
+		return;
+	}
+	for (i = 1; i < n; i++) {
+		if (i > 1) {
+			if (split) {
+				sb_flush(cur, e);
+			}
+			else {
+				sb_append(cur, " ", 1);
+			}
+		}
+		sb_append(cur, positional[i], strlen(positional[i]));
+	}
+}
+
+/* Expand one word, pushing its fields (or the single word) onto e */
+static char *expand_one(char *word, expansion *e, int split) {
+	char *inner, *end;
+	size_t len;
+
+	/* A word that is exactly one substitution is split in place */
+	if (is_substitution(word) &&
+	    *substitution_end(word, &inner, &len) == '\0') {
+		capture *c = substitute(word, &end, e);
+		if (!c) {
+			return NULL;
+		}
+		char *p = c->data;
+		if (!split) {
+			size_t n = c->size;
+			while (n > 0 && p[n-1] == '\n') {
+				p[--n] = '\0';
+			}
+			return p;
+		}
+		while (*p) {
+			while (is_ifs(*p)) {
+				*p++ = '\0';
+			}
+			if (!*p) {
+				break;
+			}
+			push_word(e, p);
+			while (*p && !is_ifs(*p)) {
+				p++;
+			}
+		}
+		return NULL;
+	}
+
+	strbuf cur = { NULL, 0, 0 };
+	char *p = word;
+	while (*p) {
+		if (!is_substitution(p) && !parameter_length(p)) {
+			char *lit = p;
+			while (*p && !is_substitution(p) && !parameter_length(p)) {
+				p++;
+			}
+			sb_append(&cur, lit, p - lit);
+			continue;
+		}
+		if (parameter_length(p)) {
+			expand_parameter(p, &cur, e, split);
+			p += parameter_length(p);
+			continue;
+		}
+		capture *c = substitute(p, &p, e);
+		if (!c) {
+			continue;
+		}
+		char *out = c->data, *stop = c->data + c->size;
+		/* Trailing newlines go, split or not: x$(echo y)z is xyz */
+		while (stop > out && stop[-1] == '\n') {
+			stop--;
+		}
+		if (!split) {
+			sb_append(&cur, out, stop - out);
+			continue;
+		}
+		while (out < stop) {
+			if (is_ifs(*out)) {
+				while (out < stop && is_ifs(*out)) {
+					out++;
+				}
+				sb_flush(&cur, e);
+				continue;
+			}
+			char *field = out;
+			while (out < stop && !is_ifs(*out)) {
+				out++;
+			}
+			sb_append(&cur, field, out - field);
+		}
+	}
+	if (!split) {
+		return cur.s ? keep_string(e, cur.s) : "";
+	}
+	sb_flush(&cur, e);
+	return NULL;
+}
+
+/* Expand the substitutions in tokens, with field splitting */
+int expand_words(char **tokens, expansion *e) {
+	memset(e, 0, sizeof(expansion));
+	int i;
+	for (i = 0; tokens[i]; i++) {
+		if (needs_expansion(tokens[i])) {
+			break;
+		}
+	}
+	if (!tokens[i]) {
+		/* Nothing to expand, reuse the tokens as they are */
+		e->argv = tokens;
+		return 0;
+	}
+	for (i = 0; tokens[i]; i++) {
+		if (needs_expansion(tokens[i])) {
+			expand_one(tokens[i], e, 1);
+		}
+		else {
+			push_word(e, tokens[i]);
+		}
+	}
+	if (!e->argv) {
+		push_word(e, NULL);
+		e->argc = 0;
+	}
+	return 0;
+}
+
+/* Expand a single word without field splitting (e.g. a redirection) */
+char *expand_word(char *word, expansion *e) {
+	if (!word || !needs_expansion(word)) {
+		return word;
+	}
+	char *w = expand_one(word, e, 0);
+	return w ? w : "";
+}
+
+/* Release an expansion (and its captures) */
+void release_expansion(expansion *e) {
+	if (e->cap) {
+		free(e->argv);
+	}
+	while (e->captures) {
+		capture *c = e->captures;
+		e->captures = c->next;
+		if (c->mapped) {
+			munmap(c->data, c->mapped);
+		}
+		else {
+			free(c->data);
+		}
+		free(c);
+	}
+	int i;
+	for (i = 0; i < e->nstrings; i++) {
+		free(e->strings[i]);
+	}
+	free(e->strings);
+	memset(e, 0, sizeof(expansion));
+}
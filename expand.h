@@ -0,0 +1,53 @@
+#ifndef __EXPAND_H__
+#define __EXPAND_H__
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#define MAX_PIPESTATUS 64        /* Stages kept in PIPESTATUS */
+
+/* Output of one command substitution */
+typedef struct capture_t {
+	char *data;              /* Captured bytes, NUL terminated */
+	size_t size;             /* Number of captured bytes */
+	size_t mapped;           /* Mapping length if data is an mmap'd memfd */
+	struct capture_t *next;
+} capture;
+
+/* Words produced by expanding a command's tokens */
+typedef struct expansion_t {
+	char **argv;             /* Expanded words, NULL terminated */
+	int argc, cap;
+	capture *captures;       /* Substitution outputs words point into */
+	char **strings;          /* Words built by concatenation */
+	int nstrings;
+} expansion;
+
+/* Determine if a word needs expansion */
+int needs_expansion(const char *word);
+
+/* Expand the substitutions in tokens, with field splitting */
+int expand_words(char **tokens, expansion *e);
+
+/* Expand a single word without field splitting (e.g. a redirection) */
+char *expand_word(char *word, expansion *e);
+
+/* Run a command line and capture its standard output */
+capture *capture_output(const char *text, size_t len);
+
+/* Replace the positional parameters, returns the previous ones */
+char **set_positional(char **argv);
+
+/* Set $? and the PIPESTATUS array after a command has run */
+void set_status(int status, const int *stages, int n);
+
+/* The value of $? */
+int last_status(void);
+
+/* Set $!, the pid of the last background job */
+void set_last_job(pid_t pid);
+
+/* Release an expansion (and its captures) */
+void release_expansion(expansion *e);
+
+#endif
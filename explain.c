@@ -0,0 +1,288 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "explain.h"
+#include "parser.h"
+#include "optimize.h"
+#include "pipeline.h"
+
+/**
+ * explain / explain analyze.
+ *
+ * A pipeline is flattened into its stages. explain prints them as the
+ * optimizer left them. explain analyze runs them through the pipeline
+ * executor with a metering relay on every edge. Each stage gets its
+ * own wall time, CPU time (which includes whatever it waited for) and
+ * exit status. The relays count the bytes on each edge and how long they
+ * waited on either side. A relay starved of input means the stage after
+ * it was blocked reading. A relay unable to write means the stage before
+ * it was blocked writing. The ends of the pipeline that are not pipes
+ * (a file, the terminal) are not measured.
+ */
+
+#define MAX_TEXT 1024
+
+static void print_json_string(const char *s) {
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			printf("\\%c", *s);
+		}
+		else if ((unsigned char)*s < 0x20) {
+			printf("\\u%04x", *s);
+		}
+		else {
+			putchar(*s);
+		}
+	}
+	putchar('"');
+}
+
+static void print_bytes(const char *name, const meter_stats *edge) {
+	if (!edge) {
+		printf("  %s -", name);
+	}
+	else if (edge->bytes >= 1000000) {
+		printf("  %s %.2f MB", name, edge->bytes / 1e6);
+	}
+	else if (edge->bytes >= 1000) {
+		printf("  %s %.2f KB", name, edge->bytes / 1e3);
+	}
+	else {
+		printf("  %s %lu B", name, (unsigned long)edge->bytes);
+	}
+}
+
+static void print_wait(const char *name, const meter_stats *edge, int in) {
+	if (!edge) {
+		printf("%s -", name);
+	}
+	else {
+		printf("%s %.3f s", name, (in ? edge->wait_in : edge->wait_out) / 1e9);
+	}
+}
+
+static void json_number(const char *name, const meter_stats *edge,
+			uint64_t value, int secs) {
+	printf(", \"%s\": ", name);
+	if (!edge) {
+		printf("null");
+	}
+	else if (secs) {
+		printf("%.6f", value / 1e9);
+	}
+	else {
+		printf("%lu", (unsigned long)value);
+	}
+}
+
+static double cpu_seconds(struct rusage *ru) {
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+	       ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/* Print the stages, with their measurements if edges is set */
+static void report(stage *st, int n, meter_stats *edges, uint64_t wall,
+		   int json) {
+	char text[MAX_TEXT];
+	int i;
+
+	if (json) {
+		printf("{");
+		if (edges) {
+			printf("\"wall\": %.6f, ", wall / 1e9);
+		}
+		printf("\"stages\": [");
+	}
+	else {
+		printf("pipeline: %d stage%s", n, n == 1 ? "" : "s");
+		if (edges) {
+			printf(", %.3f s", wall / 1e9);
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < n; i++) {
+		format_command(st[i].cmd, text, sizeof(text), 0);
+		/* The edges this stage reads from and writes to, if pipes */
+		meter_stats *in = edges && i > 0 ? &edges[i - 1] : NULL;
+		meter_stats *out = edges && i < n - 1 ? &edges[i] : NULL;
+
+		if (json) {
+			printf("%s{\"command\": ", i ? ", " : "");
+			print_json_string(text);
+			if (st[i].pipe) {
+				printf(", \"pipe\": ");
+				print_json_string(st[i].pipe);
+			}
+			if (edges) {
+				printf(", \"status\": %d, \"wall\": %.6f, "
+				       "\"cpu\": %.6f", st[i].status,
+				       (st[i].end - st[i].start) / 1e9,
+				       cpu_seconds(&st[i].ru));
+				json_number("bytes_in", in, in ? in->bytes : 0, 0);
+				json_number("bytes_out", out, out ? out->bytes : 0, 0);
+				json_number("blocked_read", in,
+					    in ? in->wait_in : 0, 1);
+				json_number("blocked_write", out,
+					    out ? out->wait_out : 0, 1);
+			}
+			printf("}");
+			continue;
+		}
+
+		printf("  [%d] %s%s%s\n", i + 1, st[i].pipe ? st[i].pipe : "",
+		       st[i].pipe ? " " : "", text);
+		if (edges) {
+			printf("      status %d  wall %.3f s  cpu %.3f s",
+			       st[i].status, (st[i].end - st[i].start) / 1e9,
+			       cpu_seconds(&st[i].ru));
+			print_bytes("in", in);
+			print_bytes("out", out);
+			print_wait("  blocked read", in, 1);
+			print_wait(" write", out, 0);
+			printf("\n");
+		}
+	}
+	printf(json ? "]}" : "");
+	fflush(stdout);
+}
+
+/* Lists are explained one pipeline at a time, with the operator between
+ * them as a line of text, or as {"list": op, "commands": [...]} */
+static int is_list(command *plan) {
+	return !plan->scmd && plan->cmd2 && operator_precedence(plan->oper) < 2;
+}
+
+static void list_open(command *plan, int json) {
+	if (json) {
+		printf("{\"list\": ");
+		print_json_string(plan->oper);
+		printf(", \"commands\": [");
+	}
+}
+
+static void list_next(command *plan, int json) {
+	printf(json ? ", " : "%s\n", plan->oper);
+}
+
+static void list_close(int json) {
+	if (json) {
+		printf("]}");
+	}
+}
+
+static void explain_stages(command *plan, int json) {
+	if (is_list(plan)) {
+		list_open(plan, json);
+		explain_stages(plan->cmd1, json);
+		list_next(plan, json);
+		explain_stages(plan->cmd2, json);
+		list_close(json);
+		return;
+	}
+	int n = pipeline_stages(plan, NULL);
+	stage *st = malloc(n * sizeof(stage));
+	pipeline_stages(plan, st);
+	report(st, n, NULL, 0, json);
+	free(st);
+}
+
+/* Print the stages of a plan, as text or as JSON */
+void explain_plan(command *plan, int json) {
+	explain_stages(plan, json);
+	if (json) {
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/* Run a plan pipeline by pipeline, reporting on each; returns $? */
+static int analyze_plan(command *plan, int json) {
+	if (is_list(plan)) {
+		list_open(plan, json);
+		int status = analyze_plan(plan->cmd1, json);
+		list_next(plan, json);
+		if ((plan->oper[0] == '&' && status != 0) ||
+		    (plan->oper[0] == '|' && status == 0)) {
+			/* Short-circuited */
+			printf(json ? "null" : "(skipped)\n");
+		}
+		else {
+			status = analyze_plan(plan->cmd2, json);
+		}
+		list_close(json);
+		return status;
+	}
+
+	int n = pipeline_stages(plan, NULL);
+	stage *st = malloc(n * sizeof(stage));
+	pipeline_stages(plan, st);
+
+	/* The relays write their totals straight into shared memory */
+	meter_stats *edges = mmap(NULL, n * sizeof(meter_stats),
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (edges == MAP_FAILED) {
+		perror("mmap");
+		free(st);
+		return EXIT_FAILURE;
+	}
+
+	int status = run_stages(st, n, edges);
+	uint64_t end = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		if (st[i].end > end) {
+			end = st[i].end;
+		}
+	}
+	report(st, n, edges, end - st[0].start, json);
+
+	munmap(edges, n * sizeof(meter_stats));
+	free(st);
+	return status;
+}
+
+/* Keyword: explain [analyze] [-j] command */
+int execute_explain(char **tokens) {
+	int analyze = 0, json = 0, i;
+
+	for (i = 1; tokens[i]; i++) {
+		if (!strcmp(tokens[i], "analyze")) {
+			analyze = 1;
+		}
+		else if (!strcmp(tokens[i], "-j")) {
+			json = 1;
+		}
+		else {
+			break;
+		}
+	}
+	if (!tokens[i]) {
+		fprintf(stderr, "usage: explain [analyze] [-j] command\n");
+		return EXIT_FAILURE;
+	}
+
+	command *plan = construct_command(tokens + i);
+	if (!plan) {
+		return EXIT_FAILURE;
+	}
+	plan = optimize_command(plan);
+	int status = EXIT_SUCCESS;
+	if (analyze) {
+		status = analyze_plan(plan, json);
+		printf(json ? "\n" : "");
+		fflush(stdout);
+	}
+	else {
+		explain_plan(plan, json);
+	}
+	release_command(plan);
+	return status;
+}
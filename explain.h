@@ -0,0 +1,14 @@
+#ifndef __EXPLAIN_H__
+#define __EXPLAIN_H__
+
+#include "shell.h"
+
+/* Print the stages of a plan, as text or as JSON */
+void explain_plan(command *plan, int json);
+
+/* Keyword: explain [analyze] [-j] command
+ * Prints the plan of a command line, or runs it and annotates each stage
+ * with its timings */
+int execute_explain(char **tokens);
+
+#endif
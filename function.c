@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "function.h"
+#include "parser.h"
+#include "expand.h"
+
+/**
+ * Shell functions.
+ *
+ * A body is tokenized and constructed exactly once, when the function is
+ * defined; the function keeps its own copy of the text so the plan stays
+ * valid after the defining line is gone. Calls execute the stored plan
+ * in the current process, with the call's words as positional
+ * parameters, so a function costs no fork of its own. A definition
+ * replaced while a call is running (a body may redefine itself) is kept
+ * until the outermost call returns.
+ */
+
+#define FUNCTION_BUCKETS 64
+
+typedef struct function_t {
+	char *name;
+	char *text;           /* Body text the tokens point into */
+	char **tokens;
+	command *body;        /* Plan, constructed once */
+	struct function_t *next;
+} function;
+
+static function *functions[FUNCTION_BUCKETS];
+static function *retired;        /* Replaced while calls were running */
+static int call_depth;
+
+static unsigned function_hash(const char *s) {
+	unsigned h = 2166136261u;
+	while (*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h % FUNCTION_BUCKETS;
+}
+
+static function *function_find(const char *name) {
+	function *f;
+	for (f = functions[function_hash(name)]; f; f = f->next) {
+		if (!strcmp(f->name, name)) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+static void function_free(function *f) {
+	release_command(f->body);
+	free(f->tokens);
+	free(f->text);
+	free(f->name);
+	free(f);
+}
+
+/* Look up the parsed body of a function, NULL if there is none */
+command *lookup_function(const char *name) {
+	function *f = function_find(name);
+	return f ? f->body : NULL;
+}
+
+/* Find "name() {", "name () {" or "function name {"; returns the index of
+ * the opening brace and sets *name, or returns 0 */
+static int definition_start(char **tokens, char **name, size_t *namelen) {
+	int i = 0;
+	if (!strcmp(tokens[0], "function") && tokens[1]) {
+		i = 1;
+	}
+	*name = tokens[i];
+	*namelen = strlen(tokens[i]);
+	/* The parser splits "name()" into "name", "(", ")" */
+	if (tokens[i+1] && !strcmp(tokens[i+1], "(") &&
+	    tokens[i+2] && !strcmp(tokens[i+2], ")")) {
+		i += 3;
+	}
+	else if (i == 1) {
+		i++;
+	}
+	else {
+		return 0;
+	}
+	return tokens[i] && !strcmp(tokens[i], "{") ? i : 0;
+}
+
+/* Define a function if tokens are "name() { body }" (or "function name
+ * { body }"); returns 1 if they were a definition, 0 otherwise */
+int define_function(char **tokens) {
+	char *name;
+	size_t namelen;
+	int open = definition_start(tokens, &name, &namelen);
+	if (!open) {
+		return 0;
+	}
+
+	int close = open + 1;
+	while (tokens[close]) {
+		close++;
+	}
+	if (close == open + 1 || strcmp(tokens[--close], "}")) {
+		fprintf(stderr, "%.*s: expected { body }\n", (int)namelen, name);
+		return 1;
+	}
+
+	/* Copy the body, dropping a ';' that terminates it */
+	size_t len = 1;
+	int i;
+	for (i = open + 1; i < close; i++) {
+		len += strlen(tokens[i]) + 1;
+	}
+	char *text = malloc(len);
+	text[0] = '\0';
+	for (i = open + 1; i < close; i++) {
+		strcat(text, tokens[i]);
+		strcat(text, " ");
+	}
+	len = strlen(text);
+	while (len > 0 && (text[len-1] == ' ' || text[len-1] == ';')) {
+		text[--len] = '\0';
+	}
+
+	function *f = malloc(sizeof(function));
+	f->tokens = malloc((len + 2) * sizeof(char *));
+	f->text = text;
+	parse_line(text, f->tokens);
+	f->body = f->tokens[0] ? construct_command(f->tokens) : NULL;
+	if (!f->body) {
+		fprintf(stderr, "%.*s: empty function body\n", (int)namelen, name);
+		free(f->tokens);
+		free(text);
+		free(f);
+		return 1;
+	}
+	f->name = strndup(name, namelen);
+
+	/* Replace an existing definition */
+	unsigned h = function_hash(f->name);
+	function **p;
+	for (p = &functions[h]; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->name, f->name)) {
+			function *old = *p;
+			*p = old->next;
+			if (call_depth) {
+				old->next = retired;
+				retired = old;
+			}
+			else {
+				function_free(old);
+			}
+			break;
+		}
+	}
+	f->next = functions[h];
+	functions[h] = f;
+	return 1;
+}
+
+/* Run a function body in the current process with argv as $0, $1... */
+int call_function(command *body, char **argv) {
+	char **saved = set_positional(argv);
+	call_depth++;
+	int status = execute_plan(body, 0);
+	call_depth--;
+	set_positional(saved);
+	while (!call_depth && retired) {
+		function *f = retired;
+		retired = f->next;
+		function_free(f);
+	}
+	return status;
+}
@@ -0,0 +1,16 @@
+#ifndef __FUNCTION_H__
+#define __FUNCTION_H__
+
+#include "shell.h"
+
+/* Define a function if tokens are "name() { body }" (or "function name
+ * { body }"); returns 1 if they were a definition, 0 otherwise */
+int define_function(char **tokens);
+
+/* Look up the parsed body of a function, NULL if there is none */
+command *lookup_function(const char *name);
+
+/* Run a function body in the current process with argv as $0, $1... */
+int call_function(command *body, char **argv);
+
+#endif
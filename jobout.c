@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobout.h"
+#include "options.h"
+
+/**
+ * Multiplexed job output.
+ *
+ * Background jobs writing to the same terminal or file interleave their
+ * output mid-line. With set -o jobmux, a job's stdout and stderr go into
+ * pipes instead, and the job's process relays them to the real
+ * destinations after forking the command itself. The relay writes only
+ * whole lines. Every write happens under one lock shared by the relays
+ * of all jobs, so no line is ever split by another job's output.
+ * set -o jobtags prefixes each line with the job's number, "[N] ". With
+ * set -o jobbuffer, a job's output is held in a memfd until the job is
+ * done, then written out in one go: all of stdout, then all of stderr.
+ * Without tags the bytes are spliced into the memfd and sent out with
+ * sendfile, so they never pass through user space.
+ *
+ * The relay exits with the command's status after writing everything
+ * out, so "wait" returns only once a job's output has been written.
+ */
+
+#define JOBOUT_CHUNK (64 * 1024)
+#define JOBOUT_LINE_MAX (64 * 1024)      /* Longer lines go out in pieces */
+
+/* Serializes the relays' writes, in memory shared by all of them */
+static pthread_mutex_t *jobout_lock;
+
+typedef struct stream {
+	int in;                  /* Read end of the job's pipe, -1 at EOF */
+	int out;                 /* Where the output goes */
+	int held;                /* memfd for jobbuffer, or -1 */
+	char *line;              /* Partial line, not yet written */
+	size_t len, cap;
+} stream;
+
+static int tags, id;
+
+/* Whether job output is to be relayed */
+int jobout_enabled(void) {
+	return shell_options[OPTION_JOBMUX] || shell_options[OPTION_JOBTAGS] ||
+	       shell_options[OPTION_JOBBUFFER];
+}
+
+/* Set up what the relays of all jobs share */
+void jobout_init(void) {
+	pthread_mutexattr_t attr;
+
+	if (jobout_lock) {
+		return;
+	}
+	jobout_lock = mmap(NULL, sizeof(pthread_mutex_t),
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			   -1, 0);
+	if (jobout_lock == MAP_FAILED) {
+		jobout_lock = NULL;
+		return;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	/* A relay killed while writing must not block the others */
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(jobout_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void lock_output(void) {
+	if (jobout_lock && pthread_mutex_lock(jobout_lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(jobout_lock);
+	}
+}
+
+static void unlock_output(void) {
+	if (jobout_lock) {
+		pthread_mutex_unlock(jobout_lock);
+	}
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Write lines out, tagged if set to: straight to the destination under
+ * the lock, or into the memfd holding the job's output */
+static void emit(stream *s, const char *buf, size_t len) {
+	char tag[32];
+	int fd = s->held != -1 ? s->held : s->out;
+
+	if (!tags) {
+		if (s->held == -1) {
+			lock_output();
+		}
+		write_all(fd, buf, len);
+		if (s->held == -1) {
+			unlock_output();
+		}
+		return;
+	}
+
+	/* Tag every line, into one write */
+	int taglen = snprintf(tag, sizeof(tag), "[%d] ", id);
+	size_t lines = 0, i, n = 0;
+	for (i = 0; i < len; i++) {
+		lines += buf[i] == '\n';
+	}
+	lines += len && buf[len - 1] != '\n';
+	char *tagged = malloc(len + lines * taglen);
+	for (i = 0; i < len; i++) {
+		if (i == 0 || buf[i - 1] == '\n') {
+			memcpy(tagged + n, tag, taglen);
+			n += taglen;
+		}
+		tagged[n++] = buf[i];
+	}
+	if (s->held == -1) {
+		lock_output();
+	}
+	write_all(fd, tagged, n);
+	if (s->held == -1) {
+		unlock_output();
+	}
+	free(tagged);
+}
+
+/* Move whatever the job wrote on one stream along, complete lines only */
+static void relay(stream *s, int buffered) {
+	char chunk[JOBOUT_CHUNK];
+
+	if (buffered && !tags) {
+		/* Nothing to look at: pipe to memfd in the kernel */
+		ssize_t n = splice(s->in, NULL, s->held, NULL, JOBOUT_CHUNK,
+				   SPLICE_F_MOVE);
+		if (n != -1 || errno != EINVAL) {
+			if (n == 0 || (n == -1 && errno != EINTR &&
+				       errno != EAGAIN)) {
+				close(s->in);
+				s->in = -1;
+			}
+			return;
+		}
+	}
+
+	ssize_t n = read(s->in, chunk, sizeof(chunk));
+	if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	if (n <= 0) {
+		/* End of the stream: what's left is an unterminated line */
+		if (s->len) {
+			emit(s, s->line, s->len);
+		}
+		s->len = 0;
+		close(s->in);
+		s->in = -1;
+		return;
+	}
+
+	if (s->len + n > s->cap) {
+		s->cap = (s->len + n) * 2;
+		s->line = realloc(s->line, s->cap);
+	}
+	memcpy(s->line + s->len, chunk, n);
+	s->len += n;
+
+	/* Everything up to the last newline goes out now */
+	char *end = memrchr(s->line, '\n', s->len);
+	size_t whole = end ? end + 1 - s->line : 0;
+	if (!whole && s->len >= JOBOUT_LINE_MAX) {
+		whole = s->len;
+	}
+	if (whole) {
+		emit(s, s->line, whole);
+		memmove(s->line, s->line + whole, s->len - whole);
+		s->len -= whole;
+	}
+}
+
+/* Write out a job's held output in one piece */
+static void release_held(stream *s, int count) {
+	int i;
+	lock_output();
+	for (i = 0; i < count; i++) {
+		off_t size = lseek(s[i].held, 0, SEEK_END), off = 0;
+		while (off < size) {
+			ssize_t n = sendfile(s[i].out, s[i].held, &off, size - off);
+			if (n <= 0) {
+				/* Not every destination takes sendfile */
+				char chunk[JOBOUT_CHUNK];
+				n = pread(s[i].held, chunk, sizeof(chunk), off);
+				if (n <= 0) {
+					break;
+				}
+				write_all(s[i].out, chunk, n);
+				off += n;
+			}
+		}
+	}
+	unlock_output();
+}
+
+/* Run a job's command with its stdout and stderr relayed */
+void jobout_run(command *c, int job) {
+	int buffered = shell_options[OPTION_JOBBUFFER];
+	stream s[2];
+	int fd, pfd[2][2];
+
+	tags = shell_options[OPTION_JOBTAGS];
+	id = job;
+	for (fd = 0; fd < 2; fd++) {
+		if (pipe2(pfd[fd], O_CLOEXEC) == -1) {
+			perror("pipe");
+			execute_complex_command(c);
+		}
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		dup2(pfd[0][1], STDOUT_FILENO);
+		dup2(pfd[1][1], STDERR_FILENO);
+		for (fd = 0; fd < 2; fd++) {
+			close(pfd[fd][0]);
+			close(pfd[fd][1]);
+		}
+		execute_complex_command(c);
+	}
+
+	for (fd = 0; fd < 2; fd++) {
+		close(pfd[fd][1]);
+		s[fd].in = pfd[fd][0];
+		s[fd].out = fd + 1;
+		s[fd].held = buffered ? memfd_create("job-output", MFD_CLOEXEC) : -1;
+		s[fd].line = NULL;
+		s[fd].len = s[fd].cap = 0;
+	}
+	if (buffered && (s[0].held == -1 || s[1].held == -1)) {
+		/* Hold both streams or neither, so none is lost */
+		perror("memfd_create");
+		for (fd = 0; fd < 2; fd++) {
+			if (s[fd].held != -1) {
+				close(s[fd].held);
+				s[fd].held = -1;
+			}
+		}
+		buffered = 0;
+	}
+
+	while (s[0].in != -1 || s[1].in != -1) {
+		struct pollfd pfds[2];
+		for (fd = 0; fd < 2; fd++) {
+			pfds[fd].fd = s[fd].in;
+			pfds[fd].events = POLLIN;
+			pfds[fd].revents = 0;
+		}
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (fd = 0; fd < 2; fd++) {
+			if (pfds[fd].revents) {
+				relay(&s[fd], s[fd].held != -1);
+			}
+		}
+	}
+	if (buffered) {
+		release_held(s, 2);
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+}
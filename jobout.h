@@ -0,0 +1,17 @@
+#ifndef __JOBOUT_H__
+#define __JOBOUT_H__
+
+#include "shell.h"
+
+/* Whether job output is to be relayed (set -o jobmux, jobtags or
+ * jobbuffer) */
+int jobout_enabled(void);
+
+/* Set up what the relays of all jobs share; call before starting one */
+void jobout_init(void);
+
+/* Run a job's command with its stdout and stderr relayed, in the job's
+ * own process; exits with the command's status */
+void jobout_run(command *c, int id);
+
+#endif
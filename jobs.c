@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "parser.h"
+#include "expand.h"
+#include "cmdlog.h"
+#include "jobout.h"
+
+/**
+ * Background jobs ("cmd &").
+ *
+ * Each job is one child, in a process group of its own, running the
+ * command the way a subshell would. Jobs finish whenever they like, so
+ * they are reaped by a SIGCHLD handler. The handler only calls wait4
+ * (WNOHANG) on the pids of running jobs, never on -1, so it can't take
+ * the status of a foreground command that is waited for directly.
+ *
+ * The handler hands each completion to the main loop through a
+ * single-producer, single-consumer ring of (pid, status, rusage)
+ * records: two atomic counters, no locks, no malloc in signal context.
+ * The main loop drains the ring before each prompt, and in jobs and
+ * wait. If the ring is full the handler leaves the child unreaped (a
+ * zombie keeps its status), and the main loop reaps it after draining.
+ * Other threads block every signal, so the handler is the only
+ * producer.
+ */
+
+#define JOB_RING 256             /* Completions in flight, a power of 2 */
+
+/* One reaped child, as the handler saw it */
+typedef struct completion {
+	pid_t pid;
+	int status;
+	uint64_t end;
+	struct rusage ru;
+} completion;
+
+static completion ring[JOB_RING];
+static atomic_uint ring_head;    /* Next to drain, main loop only */
+static atomic_uint ring_tail;    /* Next to fill, handler only */
+static volatile sig_atomic_t ring_full;  /* Children were left unreaped */
+
+/* Pids of the jobs still running, for the handler. Only changed by the
+ * main loop with SIGCHLD blocked, or by the handler itself. */
+static pid_t *running;
+static volatile sig_atomic_t nrunning;
+static int running_cap;
+
+typedef struct job {
+	int id;                  /* %N; 0 for a free slot */
+	pid_t pid;
+	int done, status;
+	int inherited;           /* The parent shell's, listed but not ours */
+	uint64_t start;
+	char *text;
+} job;
+
+static job *jobs;                /* Main loop only */
+static int njobs;
+
+static int handler_installed;
+
+/* Reap the running jobs that have exited into the ring; runs in the
+ * handler, or in the main loop with SIGCHLD blocked */
+static void reap_running(void) {
+	int i = 0;
+	while (i < nrunning) {
+		unsigned tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit(&ring_head, memory_order_acquire);
+		if (tail - head == JOB_RING) {
+			/* Full: leave the rest as zombies for now */
+			ring_full = 1;
+			return;
+		}
+		completion *c = &ring[tail % JOB_RING];
+		if (wait4(running[i], &c->status, WNOHANG, &c->ru) <= 0) {
+			i++;
+			continue;
+		}
+		c->pid = running[i];
+		c->end = cmdlog_now();
+		atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+		running[i] = running[--nrunning];
+	}
+}
+
+static void sigchld_handler(int sig) {
+	int saved = errno;
+	reap_running();
+	errno = saved;
+}
+
+static void block_sigchld(sigset_t *old) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+/* The job with a pid, preferring one still running: the pid of a job
+ * that finished may have been reused */
+static job *find_pid(pid_t pid) {
+	job *found = NULL;
+	int i;
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].id && jobs[i].pid == pid &&
+		    (!found || !jobs[i].done)) {
+			found = &jobs[i];
+		}
+	}
+	return found;
+}
+
+/* Take the completions out of the ring into the job table; returns how
+ * many there were */
+static int drain_ring(void) {
+	unsigned head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	int n = tail - head;
+
+	for (; head != tail; head++) {
+		completion *c = &ring[head % JOB_RING];
+		job *j = find_pid(c->pid);
+		if (!j || j->done) {
+			continue;
+		}
+		j->done = 1;
+		j->status = WIFSIGNALED(c->status) ?
+			128 + WTERMSIG(c->status) : WEXITSTATUS(c->status);
+		/* Log it as if it had just ended */
+		cmdlog_record(j->text, j->start + cmdlog_now() - c->end,
+			      j->status, &c->ru);
+	}
+	atomic_store_explicit(&ring_head, head, memory_order_release);
+	return n;
+}
+
+/* Drain the ring, and reap whatever it had no room for, with SIGCHLD
+ * blocked */
+static void collect_blocked(void) {
+	drain_ring();
+	ring_full = 0;
+	do {
+		reap_running();
+	} while (drain_ring());
+}
+
+static void collect_jobs(void) {
+	sigset_t old;
+	drain_ring();
+	if (!ring_full) {
+		return;
+	}
+	block_sigchld(&old);
+	collect_blocked();
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void free_job(job *j) {
+	free(j->text);
+	j->text = NULL;
+	j->id = 0;
+}
+
+/* A child can list its parent's jobs ("jobs -p | ..."), but they are
+ * not its children to wait for */
+static void inherit_jobs(void) {
+	int i;
+	for (i = 0; i < njobs; i++) {
+		jobs[i].inherited = 1;
+	}
+	nrunning = 0;
+	atomic_store(&ring_head, 0);
+	atomic_store(&ring_tail, 0);
+}
+
+static void install_handler(void) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigchld_handler;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, NULL);
+	pthread_atfork(NULL, NULL, inherit_jobs);
+	handler_installed = 1;
+}
+
+/* A free slot in the job table; its index + 1 is the job number */
+static job *new_job(void) {
+	int i;
+	for (i = 0; i < njobs; i++) {
+		if (!jobs[i].id) {
+			break;
+		}
+	}
+	if (i == njobs) {
+		jobs = realloc(jobs, ++njobs * sizeof(job));
+	}
+	memset(&jobs[i], 0, sizeof(job));
+	jobs[i].id = i + 1;
+	return &jobs[i];
+}
+
+/* Start a command in the background as a job of its own */
+int start_job(command *c) {
+	char text[1024];
+	sigset_t old;
+
+	if (!handler_installed) {
+		install_handler();
+	}
+	int relayed = jobout_enabled();
+	if (relayed) {
+		jobout_init();
+	}
+	format_command(c, text, sizeof(text), 0);
+
+	/* The handler must not see the child exit before it is listed */
+	block_sigchld(&old);
+	job *j = new_job();
+	fflush(stdout);
+	uint64_t start = cmdlog_now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		setpgid(0, 0);
+		signal(SIGTTOU, SIG_DFL);
+		if (!shell_interactive) {
+			/* Without job control, jobs don't read the shell's
+			 * input */
+			int null = open("/dev/null", O_RDONLY);
+			if (null != -1) {
+				dup2(null, STDIN_FILENO);
+				close(null);
+			}
+		}
+		if (relayed) {
+			jobout_run(c, j->id);
+		}
+		execute_complex_command(c);
+	}
+	if (pid == -1) {
+		perror("fork");
+		j->id = 0;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		return EXIT_FAILURE;
+	}
+	setpgid(pid, pid);
+
+	if (nrunning == running_cap) {
+		running_cap = running_cap ? running_cap * 2 : 16;
+		running = realloc(running, running_cap * sizeof(pid_t));
+	}
+	running[nrunning++] = pid;
+	j->pid = pid;
+	j->start = start;
+	j->text = strdup(text);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	set_last_job(pid);
+	if (shell_interactive) {
+		fprintf(stderr, "[%d] %d\n", j->id, (int)pid);
+	}
+	return EXIT_SUCCESS;
+}
+
+static void print_job(job *j, int pids) {
+	char state[32];
+	if (!j->done) {
+		snprintf(state, sizeof(state), "Running");
+	}
+	else if (j->status) {
+		snprintf(state, sizeof(state), "Exit %d", j->status);
+	}
+	else {
+		snprintf(state, sizeof(state), "Done");
+	}
+	if (pids) {
+		printf("[%d] %d %-10s %s\n", j->id, (int)j->pid, state, j->text);
+	}
+	else {
+		printf("[%d] %-10s %s\n", j->id, state, j->text);
+	}
+}
+
+/* Collect the jobs that finished, and in an interactive shell report
+ * them */
+void notify_jobs(void) {
+	int i;
+	if (!handler_installed) {
+		return;
+	}
+	collect_jobs();
+	for (i = 0; shell_interactive && i < njobs; i++) {
+		if (jobs[i].id && jobs[i].done) {
+			print_job(&jobs[i], 0);
+			free_job(&jobs[i]);
+		}
+	}
+	fflush(stdout);
+}
+
+/* Builtin: jobs [-l|-p]. Finished jobs are listed one last time. */
+int execute_jobs(char **words) {
+	int i, pids = 0, only_pids = 0;
+
+	for (i = 1; words[i]; i++) {
+		if (!strcmp(words[i], "-l")) {
+			pids = 1;
+		}
+		else if (!strcmp(words[i], "-p")) {
+			only_pids = 1;
+		}
+		else {
+			fprintf(stderr, "usage: jobs [-l|-p]\n");
+			return EXIT_FAILURE;
+		}
+	}
+	collect_jobs();
+	for (i = 0; i < njobs; i++) {
+		if (!jobs[i].id) {
+			continue;
+		}
+		if (only_pids) {
+			printf("%d\n", (int)jobs[i].pid);
+		}
+		else {
+			print_job(&jobs[i], pids);
+		}
+		if (jobs[i].done) {
+			free_job(&jobs[i]);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/* The job a wait operand names: %N or a pid */
+static job *find_job(const char *word) {
+	int i;
+	if (word[0] == '%') {
+		i = atoi(word + 1) - 1;
+		return i >= 0 && i < njobs && jobs[i].id ? &jobs[i] : NULL;
+	}
+	return find_pid(atoi(word));
+}
+
+/* Sleep until the job (or every job, if NULL) has finished */
+static void wait_for(job *target) {
+	sigset_t old;
+	int i, left;
+
+	block_sigchld(&old);
+	do {
+		collect_blocked();
+		for (i = left = 0; i < njobs; i++) {
+			if (jobs[i].id && !jobs[i].done && !jobs[i].inherited &&
+			    (!target || &jobs[i] == target)) {
+				left++;
+			}
+		}
+		if (left) {
+			/* Any SIGCHLD since the check is pending, so this
+			 * can't miss it */
+			sigsuspend(&old);
+		}
+	} while (left);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Builtin: wait [%job|pid...]. Waits for the jobs named, or all of them;
+ * the status is that of the last one named (127 if it isn't a job). */
+int execute_wait(char **words) {
+	int i, status = EXIT_SUCCESS;
+
+	if (!words[1]) {
+		wait_for(NULL);
+		for (i = 0; i < njobs; i++) {
+			if (jobs[i].id) {
+				free_job(&jobs[i]);
+			}
+		}
+		return EXIT_SUCCESS;
+	}
+	for (i = 1; words[i]; i++) {
+		job *j = find_job(words[i]);
+		if (!j || j->inherited) {
+			fprintf(stderr, "wait: %s: no such job\n", words[i]);
+			status = 127;
+			continue;
+		}
+		wait_for(j);
+		status = j->status;
+		free_job(j);
+	}
+	return status;
+}
@@ -0,0 +1,17 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include "shell.h"
+
+/* Start a command in the background as a job of its own; returns $? */
+int start_job(command *c);
+
+/* Collect the jobs that finished, and in an interactive shell report
+ * them; called before each prompt */
+void notify_jobs(void);
+
+/* Builtins: jobs [-l|-p], wait [%job|pid...] */
+int execute_jobs(char **words);
+int execute_wait(char **words);
+
+#endif
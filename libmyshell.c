@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libmyshell.h"
+#include "parser.h"
+
+/**
+ * The library side of the shell: parsing into an arena, and an executor
+ * that only ever touches the descriptors it opens itself. Commands never
+ * run in this process, and the process's own stdin, stdout and stderr
+ * are never redirected: each command gets its descriptors through the
+ * spawn callback instead of dup2 in the caller.
+ */
+
+extern char **environ;
+
+/* Parse a line into a plan allocated from a */
+msh_plan *msh_parse(arena *a, const char *line) {
+	size_t used = a->used;
+	msh_plan *plan = NULL;
+
+	/* parse_line cuts the copy up in place; the tokens point into it */
+	char *copy = arena_strdup(a, line);
+	char **tokens = copy ?
+		arena_alloc(a, (strlen(line) + 2) * sizeof(char *)) : NULL;
+	if (tokens) {
+		parse_line(copy, tokens);
+		plan = tokens[0] ? construct_command_in(tokens, a) : NULL;
+	}
+	if (!plan) {
+		a->used = used;
+	}
+	return plan;
+}
+
+static pid_t default_spawn(void *ctx, char *const argv[], const int fds[3]) {
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+	int i, err;
+
+	posix_spawn_file_actions_init(&actions);
+	for (i = 0; i < 3; i++) {
+		if (fds[i] != i) {
+			posix_spawn_file_actions_adddup2(&actions, fds[i], i);
+		}
+	}
+	err = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
+
+static int default_wait(void *ctx, pid_t pid) {
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* Open redirections over fds, remembering what was opened so it can be
+ * closed again; returns -1 if a file can't be opened */
+static int open_redirections(const char *in, const char *out, const char *err,
+			     int fds[3], int opened[3]) {
+	const char *files[3] = { in, out, err };
+	int fd;
+
+	opened[0] = opened[1] = opened[2] = -1;
+	for (fd = 0; fd < 3; fd++) {
+		if (!files[fd]) {
+			continue;
+		}
+		if (fd == STDERR_FILENO && files[fd] == files[STDOUT_FILENO]) {
+			/* &> shares one open file */
+			fds[fd] = fds[STDOUT_FILENO];
+			continue;
+		}
+		opened[fd] = fd == STDIN_FILENO ?
+			open(files[fd], O_RDONLY | O_CLOEXEC) :
+			open(files[fd], O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0664);
+		if (opened[fd] == -1) {
+			return -1;
+		}
+		fds[fd] = opened[fd];
+	}
+	return 0;
+}
+
+static void close_redirections(int opened[3]) {
+	int fd;
+	for (fd = 0; fd < 3; fd++) {
+		if (opened[fd] != -1) {
+			close(opened[fd]);
+		}
+	}
+}
+
+/* Start a simple command; returns its pid, 0 if there is nothing to run,
+ * or -status if it couldn't be started */
+static pid_t spawn_simple(simple_command *s, const msh_callbacks *cb,
+			  const int fds[3]) {
+	int sfds[3] = { fds[0], fds[1], fds[2] }, opened[3];
+	pid_t pid = 0;
+
+	if (open_redirections(s->in, s->out, s->err, sfds, opened) == -1) {
+		pid = -1;
+	}
+	else if (s->tokens[0]) {
+		pid = cb->spawn(cb->ctx, s->tokens, sfds);
+		if (pid == -1) {
+			pid = errno == ENOENT ? -127 : -126;
+		}
+	}
+	close_redirections(opened);
+	return pid;
+}
+
+static int wait_status(pid_t pid, const msh_callbacks *cb) {
+	if (pid <= 0) {
+		return -pid;
+	}
+	int status = cb->wait(cb->ctx, pid);
+	return status == -1 ? 1 : status;
+}
+
+static int is_pipe(const command *c) {
+	return !c->scmd && c->cmd2 && operator_precedence(c->oper) == 2;
+}
+
+static int run_plan(const command *c, const msh_callbacks *cb, const int fds[3]);
+
+/* Start every stage with a pipe between each pair, then wait for all of
+ * them; the status is the last stage's */
+static int run_pipeline(const command *c, const msh_callbacks *cb,
+			const int fds[3]) {
+	const command *p;
+	int n = 1, i, started, status = 0, in = fds[0];
+
+	for (p = c; is_pipe(p); p = p->cmd2) {
+		n++;
+	}
+	pid_t *pids = malloc(n * sizeof(pid_t));
+	if (!pids) {
+		return 1;
+	}
+
+	for (i = 0, p = c; i < n; i++) {
+		const command *stage = i < n - 1 ? p->cmd1 : p;
+		int pfd[2] = { -1, -1 }, sfds[3] = { in, fds[1], fds[2] };
+
+		if (i < n - 1 && pipe2(pfd, O_CLOEXEC) == -1) {
+			break;
+		}
+		if (pfd[1] != -1) {
+			sfds[1] = pfd[1];
+		}
+		/* Groups and lists would need a process of their own */
+		pids[i] = stage->scmd ? spawn_simple(stage->scmd, cb, sfds) : -1;
+
+		/* Only the stages hold their pipe ends from here on */
+		if (in != fds[0]) {
+			close(in);
+		}
+		if (pfd[1] != -1) {
+			close(pfd[1]);
+		}
+		in = pfd[0];
+		p = i < n - 1 ? p->cmd2 : p;
+	}
+	if (in != fds[0] && in != -1) {
+		close(in);
+	}
+
+	started = i;
+	for (i = 0; i < started; i++) {
+		status = wait_status(pids[i], cb);
+	}
+	free(pids);
+	return started == n ? status : 1;
+}
+
+static int run_plan(const command *c, const msh_callbacks *cb, const int fds[3]) {
+	if (c->scmd) {
+		return wait_status(spawn_simple(c->scmd, cb, fds), cb);
+	}
+
+	if (!c->cmd2) {
+		/* A group or subshell: its redirections apply to its body */
+		int gfds[3] = { fds[0], fds[1], fds[2] }, opened[3], status = 1;
+		if (open_redirections(c->in, c->out, c->err, gfds, opened) != -1) {
+			status = run_plan(c->cmd1, cb, gfds);
+		}
+		close_redirections(opened);
+		return status;
+	}
+
+	if (is_pipe(c)) {
+		return run_pipeline(c, cb, fds);
+	}
+
+	int status = run_plan(c->cmd1, cb, fds);
+	if ((!strcmp(c->oper, "&&") && status != 0) ||
+	    (!strcmp(c->oper, "||") && status == 0)) {
+		return status;
+	}
+	return run_plan(c->cmd2, cb, fds);
+}
+
+/* Run a plan and wait for it; returns its exit status */
+int msh_execute(const msh_plan *plan, const msh_callbacks *cb) {
+	msh_callbacks callbacks = { default_spawn, default_wait, NULL };
+	const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+
+	if (!plan) {
+		return -1;
+	}
+	if (cb) {
+		callbacks.ctx = cb->ctx;
+		if (cb->spawn) {
+			callbacks.spawn = cb->spawn;
+		}
+		if (cb->wait) {
+			callbacks.wait = cb->wait;
+		}
+	}
+	return run_plan(plan, &callbacks, fds);
+}
+
+/* Render a plan back into a single line of text */
+size_t msh_format(const msh_plan *plan, char *buf, size_t size) {
+	if (size) {
+		buf[0] = '\0';
+	}
+	return format_command((command *)plan, buf, size, 0);
+}
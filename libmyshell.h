@@ -0,0 +1,60 @@
+#ifndef __LIBMYSHELL_H__
+#define __LIBMYSHELL_H__
+
+/**
+ * libmyshell: the shell's parser and pipeline setup as a library.
+ *
+ *     char mem[16384];
+ *     arena a;
+ *     arena_init(&a, mem, sizeof(mem));
+ *     msh_plan *plan = msh_parse(&a, "sort < in | uniq -c > out && echo ok");
+ *     int status = plan ? msh_execute(plan, NULL) : -1;
+ *     arena_reset(&a);
+ *
+ * A plan lives entirely in the caller's arena, together with its own copy
+ * of the line, and is freed by resetting the arena. Nothing is kept in
+ * globals, so threads may parse and execute concurrently as long as each
+ * uses its own arena. Every descriptor the library opens is close-on-exec,
+ * so a spawn in one thread never inherits another thread's pipes.
+ *
+ * Plans run programs only: words are not expanded, and there are no
+ * builtins, aliases or functions, which all belong to a shell process.
+ * Lists (";", "&&", "||") and "{ }" / "( )" groups run as in the shell,
+ * except that a subshell does not fork. A pipeline stage must be a
+ * simple command, metered and sharded pipes ("|!", "|N|") are plain ones,
+ * and a background
+ * command ("&") runs in the foreground.
+ */
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+typedef struct command_t msh_plan;
+
+/* How commands are started and waited for. Either may be NULL for the
+ * default: posix_spawnp and waitpid. */
+typedef struct msh_callbacks {
+	/* Start argv with fds[0..2] as its stdin, stdout and stderr (the
+	 * other descriptors are close-on-exec); returns its pid or -1 */
+	pid_t (*spawn)(void *ctx, char *const argv[], const int fds[3]);
+	/* Wait for a started pid; returns its exit status (128+N if killed
+	 * by signal N) or -1 */
+	int (*wait)(void *ctx, pid_t pid);
+	void *ctx;
+} msh_callbacks;
+
+/* Parse a line into a plan allocated from a. The line is copied, not
+ * modified. Returns NULL on a syntax error or if the arena is full. */
+msh_plan *msh_parse(arena *a, const char *line);
+
+/* Run a plan and wait for it; returns its exit status as the shell would
+ * set $?: 127 for a program that isn't found, 126 for one that can't be
+ * started, 1 for a failed redirection */
+int msh_execute(const msh_plan *plan, const msh_callbacks *cb);
+
+/* Render a plan back into a single line of text; returns its length */
+size_t msh_format(const msh_plan *plan, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lookahead.h"
+#include "parser.h"
+#include "expand.h"
+#include "pathcache.h"
+
+/**
+ * Script lookahead.
+ *
+ * While a script's command runs, the shell would only sit in wait. A
+ * helper thread reads up to LOOKAHEAD_LINES lines ahead instead and
+ * tokenizes a copy of each. It resolves their programs into the PATH
+ * cache, and asks the kernel to read ahead the binaries and the files
+ * redirected into them (posix_fadvise WILLNEED). When the command
+ * finishes, the next one's program is already in the page cache.
+ *
+ * Only tokenizing is speculative. A line is still parsed for real when
+ * its turn comes, because earlier lines may define aliases and
+ * functions, change directory or set PATH. Words that need expansion
+ * are left alone. A guess that turns out wrong (a program shadowed by
+ * one an earlier line installs) only costs an unneeded read-ahead: exec
+ * still searches PATH itself.
+ * The thread never touches the shell's own state: it gets its own copy
+ * of PATH when it starts.
+ */
+
+#define LOOKAHEAD_LINES 8
+
+static struct {
+	FILE *input;
+	char *path;                      /* PATH when the script started */
+	char *lines[LOOKAHEAD_LINES];    /* Read but not yet run */
+	unsigned head, tail;             /* Next to run, next to read */
+	int done;                        /* End of the script was read */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} la = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* Have the kernel start reading a file in */
+static void advise(const char *file) {
+	struct stat st;
+	int fd = open(file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+	close(fd);
+}
+
+/* Resolve the programs of a line and read in what they will need */
+static void prepare(const char *line) {
+	char *copy = strdup(line);
+	char **tokens = malloc((strlen(line) + 2) * sizeof(char *));
+	char full[PATH_MAX];
+	int i, start = 1;
+
+	parse_line(copy, tokens);
+	for (i = 0; tokens[i]; i++) {
+		char *t = tokens[i];
+		if (is_operator(t) || !strcmp(t, "{") || !strcmp(t, "(")) {
+			/* A command starts after these */
+			start = 1;
+		}
+		else if (!strcmp(t, "<") || !strcmp(t, ">") ||
+			 !strcmp(t, "2>") || !strcmp(t, "&>")) {
+			if (tokens[i + 1] && t[0] == '<' &&
+			    !needs_expansion(tokens[i + 1])) {
+				advise(tokens[i + 1]);
+			}
+			i += tokens[i + 1] != NULL;
+		}
+		else if (start) {
+			start = 0;
+			if (!strchr(t, '/') && !needs_expansion(t) && la.path &&
+			    path_resolve(t, la.path, full, sizeof(full)) == 1) {
+				advise(full);
+			}
+		}
+	}
+	free(tokens);
+	free(copy);
+}
+
+static void *read_ahead(void *arg) {
+	char *line = NULL;
+	size_t size = 0;
+
+	while (getline(&line, &size, la.input) != -1) {
+		char *next = strdup(line);
+
+		pthread_mutex_lock(&la.lock);
+		while (la.tail - la.head == LOOKAHEAD_LINES) {
+			pthread_cond_wait(&la.cond, &la.lock);
+		}
+		la.lines[la.tail++ % LOOKAHEAD_LINES] = next;
+		pthread_cond_broadcast(&la.cond);
+		pthread_mutex_unlock(&la.lock);
+
+		/* Queued first, so the shell never waits on the lookahead */
+		prepare(line);
+	}
+	pthread_mutex_lock(&la.lock);
+	la.done = 1;
+	pthread_cond_broadcast(&la.cond);
+	pthread_mutex_unlock(&la.lock);
+	free(line);
+	return NULL;
+}
+
+/* Start reading a script ahead of execution on a helper thread */
+int lookahead_start(FILE *input) {
+	pthread_t thread;
+	sigset_t all, old;
+	const char *path = getenv("PATH");
+
+	la.input = input;
+	la.path = path ? strdup(path) : NULL;
+
+	/* Signals (SIGCHLD above all) are for the shell's own thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int err = pthread_create(&thread, NULL, read_ahead, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		free(la.path);
+		la.path = NULL;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/* The script's next line, for the caller to free; NULL at the end */
+char *lookahead_next(void) {
+	char *line = NULL;
+
+	pthread_mutex_lock(&la.lock);
+	while (la.head == la.tail && !la.done) {
+		pthread_cond_wait(&la.cond, &la.lock);
+	}
+	if (la.head != la.tail) {
+		line = la.lines[la.head++ % LOOKAHEAD_LINES];
+		pthread_cond_broadcast(&la.cond);
+	}
+	pthread_mutex_unlock(&la.lock);
+	return line;
+}
@@ -0,0 +1,14 @@
+#ifndef __LOOKAHEAD_H__
+#define __LOOKAHEAD_H__
+
+#include <stdio.h>
+
+/* Start reading a script ahead of execution on a helper thread, which
+ * from then on is the only reader of input; returns -1 if it can't */
+int lookahead_start(FILE *input);
+
+/* The script's next line, as getline read it, for the caller to free;
+ * NULL at the end of the script */
+char *lookahead_next(void);
+
+#endif
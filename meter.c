@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "meter.h"
+#include "options.h"
+
+/**
+ * Pipe meter: a relay process interposed on a pipe edge.
+ *
+ * Data moves from one pipe to the other with splice, so it is never
+ * copied through user space. The relay counts the bytes and the time it
+ * spends blocked: waiting for input means the upstream stage is the
+ * slower one, waiting for room on the output means the downstream stage
+ * is. A summary goes to stderr when the edge closes, and with
+ * pipemeter-live a progress line every second.
+ */
+
+#define METER_CHUNK (64 * 1024)
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void meter_report(const char *label, const char *what, uint64_t bytes,
+			 uint64_t elapsed, uint64_t wait_in, uint64_t wait_out) {
+	double secs = elapsed / 1e9;
+	fprintf(stderr, "pipemeter: %s: %s %.2f MB in %.3f s (%.2f MB/s), "
+		"waited %.3f s on input, %.3f s on output\n",
+		label, what, bytes / 1e6, secs, secs > 0 ? bytes / 1e6 / secs : 0,
+		wait_in / 1e9, wait_out / 1e9);
+}
+
+/* Wait for fd to become ready, adding the time spent to *waited */
+static int meter_wait(int fd, short events, uint64_t *waited, int timeout) {
+	struct pollfd p = { fd, events, 0 };
+	uint64_t t0 = now_ns();
+	int n = poll(&p, 1, timeout);
+	*waited += now_ns() - t0;
+	if (n > 0 && (p.revents & POLLERR)) {
+		return -1;
+	}
+	return n;
+}
+
+static void meter_relay(int in, int out, const char *label,
+			meter_stats *stats) {
+	uint64_t bytes = 0, wait_in = 0, wait_out = 0;
+	uint64_t start = now_ns(), last_report = start;
+	int live = shell_options[OPTION_PIPEMETER_LIVE] && !stats;
+	int timeout = live ? 1000 : -1;
+
+	signal(SIGPIPE, SIG_IGN);
+	while (1) {
+		if (live && now_ns() - last_report >= 1000000000) {
+			last_report = now_ns();
+			meter_report(label, "so far", bytes, last_report - start,
+				     wait_in, wait_out);
+		}
+
+		ssize_t n = splice(in, NULL, out, NULL, METER_CHUNK,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			bytes += n;
+			continue;
+		}
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			/* End of input, or the consumer went away */
+			break;
+		}
+
+		/* Find out which side we are blocked on */
+		struct pollfd p = { in, POLLIN, 0 };
+		if (poll(&p, 1, 0) == 0) {
+			meter_wait(in, POLLIN, &wait_in, timeout);
+		}
+		else if (meter_wait(out, POLLOUT, &wait_out, timeout) == -1) {
+			break;
+		}
+	}
+	if (stats) {
+		stats->bytes = bytes;
+		stats->elapsed = now_ns() - start;
+		stats->wait_in = wait_in;
+		stats->wait_out = wait_out;
+		return;
+	}
+	meter_report(label, "moved", bytes, now_ns() - start, wait_in, wait_out);
+}
+
+/* Start a metering relay reading from in (which it takes over); *out is
+ * set to the read end the consumer should use. With stats (in memory
+ * shared with the relay) the totals are stored there instead of being
+ * reported. Returns the relay's pid. */
+pid_t start_meter(int in, const char *label, int *out, meter_stats *stats) {
+	int mfd[2];
+	if (pipe2(mfd, O_CLOEXEC) == -1) {
+		perror("pipe");
+		return -1;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(mfd[0]);
+		close(mfd[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(mfd[0]);
+		meter_relay(in, mfd[1], label, stats);
+		exit(0);
+	}
+	close(mfd[1]);
+	close(in);
+	*out = mfd[0];
+	return pid;
+}
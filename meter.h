@@ -0,0 +1,21 @@
+#ifndef __METER_H__
+#define __METER_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Totals of one metered edge: bytes moved and nanoseconds */
+typedef struct meter_stats {
+	uint64_t bytes;
+	uint64_t elapsed;
+	uint64_t wait_in;                /* Relay starved: upstream is slow */
+	uint64_t wait_out;               /* Relay stalled: downstream is slow */
+} meter_stats;
+
+/* Start a metering relay reading from in (which it takes over); *out is
+ * set to the read end the consumer should use. With stats (in memory
+ * shared with the relay) the totals are stored there instead of being
+ * reported. Returns the relay's pid. */
+pid_t start_meter(int in, const char *label, int *out, meter_stats *stats);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __MYSHELL_BUILTIN_H__
+#define __MYSHELL_BUILTIN_H__
+
+/**
+ * Loadable builtin ABI.
+ *
+ * A plugin is a shared object exporting one struct myshell_builtin per
+ * builtin, named <name>_builtin:
+ *
+ *     static int run(const struct myshell_command *cmd) { ... }
+ *     struct myshell_builtin crc32_builtin = {
+ *         MYSHELL_BUILTIN_ABI, "crc32", run, "crc32 [file]"
+ *     };
+ *
+ * and is loaded with "enable -f ./plugin.so crc32". The builtin runs in
+ * the shell process (or in the pipeline stage it is part of): it must
+ * read and write through the descriptors it is given rather than stdio,
+ * must not exit, and returns its exit status. Only this header is part
+ * of the ABI; it does not depend on the shell's internal structures.
+ */
+
+#define MYSHELL_BUILTIN_ABI 1
+
+/* What a builtin is called with */
+struct myshell_command {
+	int abi;                 /* MYSHELL_BUILTIN_ABI */
+	int argc;
+	char **argv;             /* Expanded words, argv[0] is the name */
+	int in, out, err;        /* Standard descriptors, redirections applied */
+};
+
+struct myshell_builtin {
+	int abi;                 /* MYSHELL_BUILTIN_ABI the plugin was built for */
+	const char *name;
+	int (*run)(const struct myshell_command *cmd);
+	const char *usage;
+};
+
+#endif
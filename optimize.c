@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "optimize.h"
+#include "options.h"
+#include "expand.h"
+#include "function.h"
+#include "parser.h"
+
+/**
+ * Plan optimizer, run between construct_command and execution.
+ *
+ * Each rewrite saves a fork+exec and a copy of the data through a pipe:
+ *   cat FILE | cmd ...   ->  cmd < FILE ...   (also "cat < FILE")
+ *   ... | cat | ...      ->  ... | ...        (cat in the middle copies)
+ *   ... | cmd | cat      ->  ... | cmd        (stdout is not a terminal)
+ *   cat | cmd ...        ->  cmd ...          (stdin is not a terminal)
+ * cat is the only built-in filter this shell knows, so collapsing
+ * adjacent filter stages means dropping chains of plain cats. The two
+ * terminal rules only apply when cmd can't tell the difference. Metered
+ * and sharded edges ("|!", "|N|") are left alone, and so is a pipeline that would collapse
+ * into a lone builtin or function, which must keep running in a child.
+ * A removed cat still has its place in PIPESTATUS, with status 0, so
+ * scripts indexing it by stage see the pipeline they wrote.
+ * set +o optimize turns the optimizer off.
+ */
+
+static int is_pipe(command *c) {
+	return !c->scmd && !strcmp(c->oper, "|");
+}
+
+static int is_plain_cat(simple_command *s) {
+	return s->tokens[0] && !strcmp(s->tokens[0], "cat") &&
+	       !s->out && !s->err;
+}
+
+/* "cat" with no arguments and no redirections */
+static int is_bare_cat(simple_command *s) {
+	return is_plain_cat(s) && !s->tokens[1] && !s->in;
+}
+
+/* The file a "cat FILE" or "cat < FILE" stage reads, or NULL */
+static char *cat_source(simple_command *s) {
+	if (!is_plain_cat(s)) {
+		return NULL;
+	}
+	if (!s->tokens[1]) {
+		return s->in;
+	}
+	if (s->in || s->tokens[2] || s->tokens[1][0] == '-' ||
+	    needs_expansion(s->tokens[1])) {
+		return NULL;
+	}
+	return s->tokens[1];
+}
+
+/* A program, neither a builtin nor a function: always run in a child */
+static int runs_program(simple_command *s) {
+	return !s->builtin && s->tokens[0] && !lookup_function(s->tokens[0]);
+}
+
+/* A stage that has to run in a child process, never in the shell */
+static int must_fork(command *c) {
+	if (!c->scmd) {
+		/* A group would run in the shell, anything else forks */
+		return strcmp(c->oper, "{") != 0;
+	}
+	return runs_program(c->scmd);
+}
+
+/* The first stage of a pipeline */
+static command *first_stage(command *c) {
+	while (is_pipe(c)) {
+		c = c->cmd1;
+	}
+	return c;
+}
+
+/* Free one pipeline node and its simple command, keeping other nodes */
+static void drop_node(command *c) {
+	if (c->scmd) {
+		free(c->scmd->tokens);
+		free(c->scmd);
+	}
+	free(c);
+}
+
+static command *optimize_pipeline(command *c, int head) {
+	if (c->scmd) {
+		return c;
+	}
+	if (!strcmp(c->oper, "|!") || shard_count(c->oper, NULL)) {
+		c->cmd2 = optimize_pipeline(c->cmd2, 0);
+		return c;
+	}
+	if (!c->cmd2) {
+		/* The body of a group or subshell */
+		c->cmd1 = optimize_pipeline(c->cmd1, 1);
+		return c;
+	}
+	if (!is_pipe(c)) {
+		/* Each side of a list is a pipeline of its own */
+		c->cmd1 = optimize_pipeline(c->cmd1, 1);
+		c->cmd2 = optimize_pipeline(c->cmd2, 1);
+		return c;
+	}
+
+	c->cmd2 = optimize_pipeline(c->cmd2, 0);
+	command *next = c->cmd2;
+
+	/* ... | cat | ... */
+	if (is_pipe(next) && next->cmd1->scmd && is_bare_cat(next->cmd1->scmd)) {
+		c->cmd1->elided_after += 1 + next->cmd1->elided_after;
+		c->cmd2 = next->cmd2;
+		drop_node(next->cmd1);
+		drop_node(next);
+		next = c->cmd2;
+	}
+
+	/* ... | cmd | cat, when the output isn't a terminal anyway */
+	if (next->scmd && is_bare_cat(next->scmd) && !isatty(STDOUT_FILENO) &&
+	    (!head || must_fork(c->cmd1))) {
+		command *keep = c->cmd1;
+		keep->elided_after += 1 + next->elided_after;
+		drop_node(next);
+		drop_node(c);
+		return keep;
+	}
+
+	if (!head || !c->cmd1->scmd) {
+		return c;
+	}
+
+	/* cat FILE | cmd ..., or cat | cmd when the input isn't a terminal */
+	simple_command *cat = c->cmd1->scmd;
+	char *source = cat_source(cat);
+	command *first = first_stage(next);
+	simple_command *stage = first->scmd;
+	if ((source || (is_bare_cat(cat) && !isatty(STDIN_FILENO))) &&
+	    stage && !stage->in && runs_program(stage)) {
+		stage->in = source;
+		first->elided_before += 1 + c->cmd1->elided_before;
+		drop_node(c->cmd1);
+		drop_node(c);
+		return next;
+	}
+	return c;
+}
+
+/* Rewrite a constructed command to avoid useless processes; returns the
+ * (possibly new) root */
+command *optimize_command(command *cmd) {
+	if (!shell_options[OPTION_OPTIMIZE]) {
+		return cmd;
+	}
+	return optimize_pipeline(cmd, 1);
+}
@@ -0,0 +1,10 @@
+#ifndef __OPTIMIZE_H__
+#define __OPTIMIZE_H__
+
+#include "shell.h"
+
+/* Rewrite a constructed command to avoid useless processes; returns the
+ * (possibly new) root */
+command *optimize_command(command *cmd);
+
+#endif
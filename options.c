@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+int shell_options[OPTION_COUNT] = {
+	[OPTION_OPTIMIZE] = 1,
+};
+
+static const char *option_names[OPTION_COUNT] = {
+	[OPTION_PIPEMETER]      = "pipemeter",
+	[OPTION_PIPEMETER_LIVE] = "pipemeter-live",
+	[OPTION_OPTIMIZE]       = "optimize",
+	[OPTION_EXPLAIN]        = "explain",
+	[OPTION_PIPEKILL]       = "pipekill",
+	[OPTION_PIPETERM]       = "pipeterm",
+	[OPTION_PIPEFAIL]       = "pipefail",
+	[OPTION_JOBMUX]         = "jobmux",
+	[OPTION_JOBTAGS]        = "jobtags",
+	[OPTION_JOBBUFFER]      = "jobbuffer",
+	[OPTION_AUTOPARALLEL]   = "autoparallel",
+};
+
+/**
+ * Sets (-o) or clears (+o) shell options. Without a name, or without
+ * arguments, lists every option and its state.
+ */
+int execute_set(char **words) {
+	int i;
+
+	if (!words[1] || !words[2]) {
+		for (i = 0; i < OPTION_COUNT; i++) {
+			printf("%-16s %s\n", option_names[i],
+			       shell_options[i] ? "on" : "off");
+		}
+		return EXIT_SUCCESS;
+	}
+
+	int value;
+	if (!strcmp(words[1], "-o")) {
+		value = 1;
+	}
+	else if (!strcmp(words[1], "+o")) {
+		value = 0;
+	}
+	else {
+		fprintf(stderr, "usage: set [-o|+o name]\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < OPTION_COUNT; i++) {
+		if (!strcmp(words[2], option_names[i])) {
+			shell_options[i] = value;
+			return EXIT_SUCCESS;
+		}
+	}
+	fprintf(stderr, "set: %s: invalid option name\n", words[2]);
+	return EXIT_FAILURE;
+}
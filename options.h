@@ -0,0 +1,23 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+/* Shell options, toggled with set -o NAME / set +o NAME */
+#define OPTION_PIPEMETER      0   /* Meter every pipe edge */
+#define OPTION_PIPEMETER_LIVE 1   /* Report meters every second */
+#define OPTION_OPTIMIZE       2   /* Rewrite plans before running them */
+#define OPTION_EXPLAIN        3   /* Print each plan before running it */
+#define OPTION_PIPEKILL       4   /* SIGPIPE upstream stages on exit */
+#define OPTION_PIPETERM       5   /* SIGTERM upstream stages on exit */
+#define OPTION_PIPEFAIL       6   /* A pipeline fails if any stage does */
+#define OPTION_JOBMUX         7   /* Relay job output a line at a time */
+#define OPTION_JOBTAGS        8   /* Prefix job output lines with [N] */
+#define OPTION_JOBBUFFER      9   /* Hold job output until it is done */
+#define OPTION_AUTOPARALLEL   10  /* Run independent script lines at once */
+#define OPTION_COUNT          11
+
+extern int shell_options[OPTION_COUNT];
+
+/* Builtin: set [-o|+o name] */
+int execute_set(char **words);
+
+#endif
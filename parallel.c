@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "parser.h"
+#include "shell.h"
+#include "options.h"
+#include "optimize.h"
+#include "expand.h"
+#include "alias.h"
+#include "function.h"
+
+/**
+ * set -o autoparallel: running independent script lines at once.
+ *
+ * Each line is constructed up front and the files it touches are worked
+ * out from its simple commands: "<" files are read, ">", "2>" and "&>"
+ * files are written, and every other argument that isn't an option is
+ * taken to be both, as the shell can't know what a program does with
+ * it. A comment can declare the files instead of the arguments:
+ *
+ *   convert a.png b.jpg        # reads: a.png writes: b.jpg
+ *
+ * A program named by a path is read too. Taking stdin counts as writing
+ * it, since it consumes it: every command without a "<" of its own may
+ * read the shell's stdin, so two such lines never run at once, even
+ * plain "cmd args > out" ones. Give them "< /dev/null" to let them
+ * overlap. A line starts while earlier lines are still running unless
+ * it writes something one of them reads or writes, or reads something
+ * one of them writes; then it waits for them. Paths are compared once
+ * resolved, symlinks and all.
+ *
+ * Anything the analysis can't see through is a barrier that waits for
+ * every running line and then runs in the shell as usual: builtins
+ * (cd, set, exit, ...), functions, keywords, groups, subshells,
+ * background jobs, words with something to expand, and lines that write
+ * into a PATH directory, since that can change what later lines run.
+ * The running lines' stdout and stderr go to memfds, written out in
+ * script order as each line finishes, all of its stdout then all of its
+ * stderr. So the output and $? come out as they would have one line
+ * after another. At most as many lines run as there are CPUs, and never
+ * fewer than two.
+ */
+
+#define MAX_WINDOW 64
+#define STDIN_RESOURCE "<stdin>"         /* Never a resolved path */
+
+typedef struct pline {
+	char *text;              /* What the tokens point into */
+	char **tokens;
+	command *plan;
+	char **reads, **writes;
+	int nreads, nwrites;
+	pid_t pid;               /* 0 once reaped */
+	int pidfd;
+	int status;
+	int out, err;            /* memfds holding its output */
+} pline;
+
+static pline window[MAX_WINDOW];         /* Lines not yet written out */
+static int nwindow, running;
+
+/* A path as it will be opened: resolved, or if it doesn't exist (yet)
+ * its directory resolved */
+static char *resource(const char *word) {
+	char *path = realpath(word, NULL);
+	if (path) {
+		return path;
+	}
+	const char *slash = strrchr(word, '/');
+	char *dir = slash ? strndup(word, slash == word ? 1 : slash - word) :
+			    strdup(".");
+	char *real = realpath(dir, NULL);
+	if (!real || asprintf(&path, "%s/%s", real,
+			      slash ? slash + 1 : word) == -1) {
+		path = strdup(word);
+	}
+	free(real);
+	free(dir);
+	return path;
+}
+
+static void add_resource(char ***set, int *n, const char *word) {
+	*set = realloc(*set, (*n + 1) * sizeof(char *));
+	(*set)[(*n)++] = strcmp(word, STDIN_RESOURCE) ? resource(word) :
+			 strdup(word);
+}
+
+/* Read "# reads: a b writes: c" into the line's sets; returns whether
+ * the comment declared anything */
+static int read_declaration(pline *l, char *comment) {
+	char *save, *w;
+	int mode = 0, declared = 0;
+	for (w = strtok_r(comment, " \t", &save); w;
+	     w = strtok_r(NULL, " \t", &save)) {
+		if (!strcmp(w, "reads:") || !strcmp(w, "writes:")) {
+			mode = w[0];
+			declared = 1;
+		}
+		else if (mode == 'r') {
+			add_resource(&l->reads, &l->nreads, w);
+		}
+		else if (mode == 'w') {
+			add_resource(&l->writes, &l->nwrites, w);
+		}
+	}
+	return declared;
+}
+
+/* Where the comment starts (a '#' that begins a word), or NULL */
+static char *find_comment(char *line) {
+	char *p;
+	for (p = line; *p; p++) {
+		if (*p == '#' && (p == line || p[-1] == ' ' || p[-1] == '\t')) {
+			return p + 1;
+		}
+	}
+	return NULL;
+}
+
+/* Gather the files a plan touches; -1 if it must be a barrier */
+static int analyze(pline *l, command *c, int has_stdin, int declared) {
+	if (!c->scmd) {
+		if (operator_precedence(c->oper) == 2) {
+			return analyze(l, c->cmd1, has_stdin, declared) == -1 ||
+			       analyze(l, c->cmd2, 0, declared) == -1 ? -1 : 0;
+		}
+		if (!strcmp(c->oper, ";") || !strcmp(c->oper, "&&") ||
+		    !strcmp(c->oper, "||")) {
+			return analyze(l, c->cmd1, has_stdin, declared) == -1 ||
+			       analyze(l, c->cmd2, has_stdin, declared) == -1 ?
+			       -1 : 0;
+		}
+		/* Groups, subshells and background jobs */
+		return -1;
+	}
+
+	simple_command *s = c->scmd;
+	char *files[3] = { s->in, s->out, s->err };
+	int i;
+	if (!s->tokens[0] || s->builtin || lookup_function(s->tokens[0])) {
+		return -1;
+	}
+	for (i = 0; s->tokens[i]; i++) {
+		if (needs_expansion(s->tokens[i])) {
+			return -1;
+		}
+	}
+	for (i = 0; i < 3; i++) {
+		if (files[i] && needs_expansion(files[i])) {
+			return -1;
+		}
+	}
+
+	if (strchr(s->tokens[0], '/')) {
+		add_resource(&l->reads, &l->nreads, s->tokens[0]);
+	}
+	if (s->in) {
+		add_resource(&l->reads, &l->nreads, s->in);
+	}
+	else if (has_stdin) {
+		add_resource(&l->writes, &l->nwrites, STDIN_RESOURCE);
+	}
+	if (s->out) {
+		add_resource(&l->writes, &l->nwrites, s->out);
+	}
+	if (s->err) {
+		add_resource(&l->writes, &l->nwrites, s->err);
+	}
+	for (i = 1; !declared && s->tokens[i]; i++) {
+		if (s->tokens[i][0] != '-') {
+			add_resource(&l->reads, &l->nreads, s->tokens[i]);
+			add_resource(&l->writes, &l->nwrites, s->tokens[i]);
+		}
+	}
+	return 0;
+}
+
+/* Whether a line writes a PATH directory or something in one */
+static int writes_path(pline *l) {
+	const char *path = getenv("PATH");
+	const char *dir, *end;
+	int i, found = 0;
+	if (!path) {
+		return 0;
+	}
+	for (dir = path; *dir && !found; dir = *end ? end + 1 : end) {
+		end = strchrnul(dir, ':');
+		char *name = strndup(dir, end - dir);
+		char *real = realpath(*name ? name : ".", NULL);
+		size_t len = real ? strlen(real) : 0;
+		for (i = 0; real && i < l->nwrites && !found; i++) {
+			const char *w = l->writes[i];
+			found = !strncmp(w, real, len) &&
+				(w[len] == '\0' ||
+				 (w[len] == '/' && !strchr(w + len + 1, '/')));
+		}
+		free(real);
+		free(name);
+	}
+	return found;
+}
+
+static int intersects(char **a, int na, char **b, int nb) {
+	int i, j;
+	for (i = 0; i < na; i++) {
+		for (j = 0; j < nb; j++) {
+			if (!strcmp(a[i], b[j])) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Whether a line has to wait for one still running */
+static int conflicts(pline *l) {
+	int i;
+	for (i = 0; i < nwindow; i++) {
+		pline *e = &window[i];
+		if (e->pid &&
+		    (intersects(l->writes, l->nwrites, e->reads, e->nreads) ||
+		     intersects(l->writes, l->nwrites, e->writes, e->nwrites) ||
+		     intersects(l->reads, l->nreads, e->writes, e->nwrites))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void release_line(pline *l) {
+	int i;
+	if (l->plan) {
+		release_command(l->plan);
+	}
+	for (i = 0; i < l->nreads; i++) {
+		free(l->reads[i]);
+	}
+	for (i = 0; i < l->nwrites; i++) {
+		free(l->writes[i]);
+	}
+	free(l->reads);
+	free(l->writes);
+	free(l->tokens);
+	free(l->text);
+	memset(l, 0, sizeof(pline));
+}
+
+/* Write out a memfd's contents, sendfile first */
+static void write_held(int held, int fd) {
+	off_t off = 0, end = lseek(held, 0, SEEK_END);
+	while (off < end) {
+		ssize_t n = sendfile(fd, held, &off, end - off);
+		if (n > 0) {
+			continue;
+		}
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		/* sendfile can't write to this fd: copy through a buffer */
+		char buf[8192];
+		while ((n = pread(held, buf, sizeof(buf), off)) > 0) {
+			if (write(fd, buf, n) != n) {
+				break;
+			}
+			off += n;
+		}
+		break;
+	}
+	close(held);
+}
+
+/* Write out the finished lines at the front of the window, in order */
+static void flush_window(void) {
+	int done = 0;
+	while (done < nwindow && !window[done].pid) {
+		pline *l = &window[done++];
+		write_held(l->out, STDOUT_FILENO);
+		write_held(l->err, STDERR_FILENO);
+		set_status(l->status, &l->status, 1);
+		release_line(l);
+	}
+	memmove(window, window + done, (nwindow - done) * sizeof(pline));
+	nwindow -= done;
+}
+
+/* Reap the lines that exited, waiting for one if block is set */
+static void reap_lines(int block) {
+	struct pollfd pfds[MAX_WINDOW];
+	int i, n = 0, status;
+
+	for (i = 0; i < nwindow; i++) {
+		if (window[i].pid && window[i].pidfd != -1) {
+			pfds[n].fd = window[i].pidfd;
+			pfds[n++].events = POLLIN;
+		}
+	}
+	if (block && n && poll(pfds, n, -1) == -1 && errno != EINTR) {
+		perror("poll");
+	}
+	for (i = 0; i < nwindow; i++) {
+		pline *l = &window[i];
+		/* Without a pidfd, the oldest is waited for outright */
+		int wait = block && !n && l->pid;
+		if (l->pid && waitpid(l->pid, &status, wait ? 0 : WNOHANG) == l->pid) {
+			l->pid = 0;
+			if (l->pidfd != -1) {
+				close(l->pidfd);
+			}
+			l->status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) :
+				    WEXITSTATUS(status);
+			running--;
+			block = 0;
+		}
+	}
+	flush_window();
+}
+
+void parallel_drain(void) {
+	while (nwindow) {
+		reap_lines(1);
+	}
+}
+
+static int max_running(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus < 2 ? 2 : cpus > MAX_WINDOW ? MAX_WINDOW : cpus;
+}
+
+/* Fork a line with its output held */
+static void start_line(pline *l) {
+	l->out = memfd_create("autoparallel", MFD_CLOEXEC);
+	l->err = memfd_create("autoparallel", MFD_CLOEXEC);
+	fflush(stdout);
+	fflush(stderr);
+	l->pid = l->out == -1 || l->err == -1 ? -1 : fork();
+	if (l->pid == 0) {
+		dup2(l->out, STDOUT_FILENO);
+		dup2(l->err, STDERR_FILENO);
+		int status = execute_plan(l->plan, 1);
+		exit(status == -1 ? last_status() : status);
+	}
+	if (l->pid == -1) {
+		/* Run it after the others instead */
+		perror("autoparallel");
+		parallel_drain();
+		if (l->out != -1) {
+			close(l->out);
+		}
+		if (l->err != -1) {
+			close(l->err);
+		}
+		execute_plan(l->plan, 0);
+		release_line(l);
+		return;
+	}
+	l->pidfd = syscall(SYS_pidfd_open, l->pid, 0);
+	running++;
+	window[nwindow++] = *l;
+}
+
+/* Run a script line under set -o autoparallel: started alongside the
+ * lines before it if it can't tell the difference, else once they are
+ * done. Returns -1 if the shell should exit, 0 otherwise. */
+int parallel_line(const char *line) {
+	pline l;
+	int i;
+
+	memset(&l, 0, sizeof(l));
+	l.text = strdup(line);
+	l.tokens = malloc((strlen(line) + 2) * sizeof(char *));
+	char *comment = find_comment(l.text);
+	char *declaration = comment ? strdup(comment) : NULL;
+	parse_line(l.text, l.tokens);
+	if (!l.tokens[0]) {
+		free(declaration);
+		release_line(&l);
+		return 0;
+	}
+	expand_aliases(l.tokens, strlen(line) + 2);
+
+	/* Words that make the line more than a command to construct */
+	int barrier = shell_options[OPTION_EXPLAIN] ||
+		      !strcmp(l.tokens[0], "dag") ||
+		      !strcmp(l.tokens[0], "explain") ||
+		      !strcmp(l.tokens[0], "watch-run") ||
+		      !strcmp(l.tokens[0], "function");
+	for (i = 0; l.tokens[i]; i++) {
+		if (!strcmp(l.tokens[i], "(") || !strcmp(l.tokens[i], "{")) {
+			barrier = 1;
+		}
+	}
+	int syntax_error = 0;
+	if (!barrier) {
+		l.plan = construct_command(l.tokens);
+		barrier = syntax_error = !l.plan;
+	}
+	if (!barrier) {
+		l.plan = optimize_command(l.plan);
+		int declared = declaration && read_declaration(&l, declaration);
+		barrier = analyze(&l, l.plan, 1, declared) == -1 ||
+			  writes_path(&l);
+	}
+	free(declaration);
+	if (barrier) {
+		release_line(&l);
+		parallel_drain();
+		if (syntax_error) {
+			return 0;
+		}
+		char *copy = strdup(line);
+		int exitcode = run_line(copy, 0);
+		free(copy);
+		return exitcode;
+	}
+
+	/* Wait for a free slot, and for whatever this line depends on */
+	reap_lines(0);
+	while (nwindow == MAX_WINDOW || running == max_running() ||
+	       conflicts(&l)) {
+		reap_lines(1);
+	}
+	start_line(&l);
+	return 0;
+}
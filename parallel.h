@@ -0,0 +1,12 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+/* Run a script line under set -o autoparallel: started alongside the
+ * lines before it if it can't tell the difference, else once they are
+ * done. Returns -1 if the shell should exit, 0 otherwise. */
+int parallel_line(const char *line);
+
+/* Wait for every line still running and write out their output */
+void parallel_drain(void);
+
+#endif
@@ -1,31 +1,156 @@
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "parser.h"
 #include "shell.h"
+#include "plugin.h"
+#include "arena.h"
+
+/* Tokens that end a word, longest first so "||" isn't read as "|" */
+static char *operators[] = { "&&", "||", "|!", "|", "&", ";", "(", ")", NULL };
 
 /* Determine if a token is a special operator (like '|') */
 int is_operator(char *token) {
-	/** 
-	 * Optional: edit this if you wish to parse other operators
-	 * like ";", "&&", etc.
-	 */
-	return (strcmp(token, "|") == 0);
+	return operator_precedence(token) != -1;
+}
+
+/* Precedence of an operator token, -1 if it isn't one. Lists (";" and
+ * "&") bind loosest, then "&&" and "||", then pipes. */
+int operator_precedence(const char *token) {
+	if (!strcmp(token, ";") || !strcmp(token, "&")) {
+		return 0;
+	}
+	if (!strcmp(token, "&&") || !strcmp(token, "||")) {
+		return 1;
+	}
+	if (!strcmp(token, "|") || !strcmp(token, "|!") ||
+	    shard_count(token, NULL)) {
+		return 2;
+	}
+	return -1;
+}
+
+/* "|N|" and "|Nu|" tokens, made once */
+static char shard_ops[MAX_SHARDS + 1][2][8];
+static pthread_once_t shard_ops_once = PTHREAD_ONCE_INIT;
+
+static void make_shard_ops(void) {
+	int n;
+	for (n = 1; n <= MAX_SHARDS; n++) {
+		snprintf(shard_ops[n][0], sizeof(shard_ops[n][0]), "|%du|", n);
+		snprintf(shard_ops[n][1], sizeof(shard_ops[n][1]), "|%d|", n);
+	}
+}
+
+/* The operator token for a sharded edge */
+const char *shard_operator(int n, int ordered) {
+	if (n < 1 || n > MAX_SHARDS) {
+		return NULL;
+	}
+	pthread_once(&shard_ops_once, make_shard_ops);
+	return shard_ops[n][ordered != 0];
+}
+
+/* Copies and order of a sharded edge; 0 if the edge isn't sharded */
+int shard_count(const char *edge, int *ordered) {
+	char *end;
+	if (!edge || edge[0] != '|' || !isdigit((unsigned char)edge[1])) {
+		return 0;
+	}
+	long n = strtol(edge + 1, &end, 10);
+	int u = *end == 'u';
+	if (n < 1 || n > MAX_SHARDS || strcmp(end + u, "|")) {
+		return 0;
+	}
+	if (ordered) {
+		*ordered = !u;
+	}
+	return n;
+}
+
+/* The operator that starts at p, or NULL */
+static char *operator_at(const char *p) {
+	int i;
+	if (!strncmp(p, "&>", 2)) {
+		/* A redirection, not a background job */
+		return NULL;
+	}
+	if (p[0] == '|' && isdigit((unsigned char)p[1])) {
+		/* "|N|" or "|Nu|", a sharded pipe */
+		char *end;
+		long n = strtol(p + 1, &end, 10);
+		int u = *end == 'u';
+		if (end[u] == '|') {
+			const char *op = shard_operator(n, !u);
+			if (op) {
+				return (char *)op;
+			}
+		}
+	}
+	for (i = 0; operators[i]; i++) {
+		if (!strncmp(p, operators[i], strlen(operators[i]))) {
+			return operators[i];
+		}
+	}
+	return NULL;
 }
 
+/* The shell's own builtins; loadable ones are looked up after these */
+static const struct {
+	const char *name;
+	int id;
+} builtins[] = {
+	{ "cd",      BUILTIN_CD },
+	{ "exit",    BUILTIN_EXIT },
+	{ "pushd",   BUILTIN_PUSHD },
+	{ "popd",    BUILTIN_POPD },
+	{ "dirs",    BUILTIN_DIRS },
+	{ "j",       BUILTIN_JUMP },
+	{ "cmdlog",  BUILTIN_CMDLOG },
+	{ "alias",   BUILTIN_ALIAS },
+	{ "unalias", BUILTIN_UNALIAS },
+	{ "set",     BUILTIN_SET },
+	{ "exec",    BUILTIN_EXEC },
+	{ "enable",  BUILTIN_ENABLE },
+	{ "jobs",    BUILTIN_JOBS },
+	{ "wait",    BUILTIN_WAIT },
+	{ "tasks",   BUILTIN_TASKS },
+	{ NULL, 0 }
+};
+
 /* Determine if a command is builtin */
 int is_builtin(char *token) {
-	/** 
-	 * Optional: Edit this if you wish to handle more builtin commands 
-	 */
-	if (strcmp(token, "cd") == 0) {
-		return BUILTIN_CD;
+	int i;
+	for (i = 0; builtins[i].name; i++) {
+		if (strcmp(token, builtins[i].name) == 0) {
+			return builtins[i].id;
+		}
 	}
-	if (strcmp(token, "exit") == 0) {
-		return BUILTIN_EXIT;
+	return is_loadable(token) ? BUILTIN_LOADABLE : 0;
+}
+
+/* The arena construct_command_in is building into, per thread; with
+ * none the nodes come from malloc and go back with release_command */
+static __thread arena *parse_arena;
+
+static void *parser_alloc(size_t size) {
+	return parse_arena ? arena_alloc(parse_arena, size) : malloc(size);
+}
+
+static void parser_free(void *p) {
+	if (!parse_arena) {
+		free(p);
+	}
+}
+
+/* Drop a node that failed to construct */
+static void discard_command(command *cmd) {
+	if (!parse_arena) {
+		release_command(cmd);
 	}
-	return 0;
 }
 
 /* Determine if a path is relative or absolute (relative to root) */
@@ -45,6 +170,22 @@ int is_complex_command(char **tokens) {
 	return 0;
 }
 
+/* Skip a parenthesized command substitution starting at '(',
+ * returns the position just past the matching ')' */
+char *skip_substitution(char *p) {
+	int depth = 0;
+	do {
+		if (*p == '(') {
+			depth++;
+		}
+		else if (*p == ')') {
+			depth--;
+		}
+		p++;
+	} while (*p != '\0' && depth > 0);
+	return p;
+}
+
 /* Parse a line into its tokens/words */
 void parse_line(char *line, char **tokens) {
 	
@@ -54,7 +195,8 @@ void parse_line(char *line, char **tokens) {
 			*line++ = '\0';
 		}
 
-		if (*line == '\0') {
+		/* A comment runs to the end of the line */
+		if (*line == '\0' || *line == '#') {
       			break;
 		}
 			
@@ -62,10 +204,34 @@ void parse_line(char *line, char **tokens) {
 		*tokens++ = line;
 		//printf("token: %s\n", *(tokens-1));
 		
-		/* Ignore non-whitespace, until next whitespace delimiter */
+		/* Ignore non-whitespace, until next whitespace delimiter.
+		 * Command substitutions stay in one token even if they
+		 * contain whitespace. Operators are tokens of their own,
+		 * spaces or not: "a;b" is "a", ";", "b". */
 		while (*line != '\0' && *line != ' ' && 
 		       *line != '\t' && *line != '\n')  {
-			line++;                 
+			char *op = operator_at(line);
+			if (op) {
+				/* The operator's characters become the end of
+				 * the previous word; the token is the constant */
+				if (tokens[-1] != line) {
+					tokens++;
+				}
+				tokens[-1] = op;
+				memset(line, '\0', strlen(op));
+				line += strlen(op);
+				break;
+			}
+			if (line[0] == '$' && line[1] == '(') {
+				line = skip_substitution(line + 1);
+			}
+			else if (*line == '`') {
+				char *end = strchr(line + 1, '`');
+				line = end ? end + 1 : line + strlen(line);
+			}
+			else {
+				line++;
+			}
 		}
 	}
 	*tokens = '\0';
@@ -120,7 +286,10 @@ int extract_redirections(char** tokens, simple_command* cmd) {
 		i++;
 	}
 	
-	cmd->tokens = malloc((i-skipcnt+1) * sizeof(char*));	
+	cmd->tokens = parser_alloc((i-skipcnt+1) * sizeof(char*));
+	if (!cmd->tokens) {
+		return -1;
+	}
 	
 	int j = 0;
 	i = 0;
@@ -139,19 +308,165 @@ int extract_redirections(char** tokens, simple_command* cmd) {
 	return 0;
 }
 
+/* Nesting change of a token: +1 opens a group or subshell, -1 closes */
+static int nesting(const char *token) {
+	if (!strcmp(token, "{") || !strcmp(token, "(")) {
+		return 1;
+	}
+	if (!strcmp(token, "}") || !strcmp(token, ")")) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Find the operator to split a command at: the loosest one outside any
+ * group. "&&" and "||" split at the last one so they group to the left.
+ * ";" and "&" split at the first one, so each "&" applies only to the
+ * and-or list before it. Pipes also split at the first one. Returns -1
+ * if there is no operator. */
+static int split_point(char **tokens) {
+	int i, split = -1, lowest = 3, depth = 0;
+	for (i = 0; tokens[i]; i++) {
+		depth += nesting(tokens[i]);
+		int p = operator_precedence(tokens[i]);
+		if (p == -1 || depth > 0) {
+			continue;
+		}
+		if (p < lowest || (p == lowest && p == 1)) {
+			lowest = p;
+			split = i;
+		}
+	}
+	return split;
+}
+
+static command *new_command(void) {
+	command *cmd = parser_alloc(sizeof(command));
+	if (cmd) {
+		cmd->cmd1 = NULL;
+		cmd->cmd2 = NULL;
+		cmd->scmd = NULL;
+		cmd->oper[0] = '\0';
+		cmd->in = cmd->out = cmd->err = NULL;
+		cmd->elided_before = cmd->elided_after = 0;
+	}
+	return cmd;
+}
+
+/* Construct "a & b", split at the "&": a lone "&" node for the job, and
+ * unless the "&" ended the line, a ";" list running b after starting it */
+static command *construct_background(char **tokens, int split) {
+	command *job = new_command();
+	if (!job) {
+		return NULL;
+	}
+	strcpy(job->oper, "&");
+	tokens[split] = NULL;
+	job->cmd1 = construct_command(tokens);
+	if (!job->cmd1) {
+		discard_command(job);
+		return NULL;
+	}
+	if (!tokens[split + 1]) {
+		return job;
+	}
+
+	command *list = new_command();
+	if (!list) {
+		discard_command(job);
+		return NULL;
+	}
+	strcpy(list->oper, ";");
+	list->cmd1 = job;
+	list->cmd2 = construct_command(tokens + split + 1);
+	if (!list->cmd2) {
+		discard_command(list);
+		return NULL;
+	}
+	return list;
+}
+
+/* Construct a "{ ... }" group or "( ... )" subshell into cmd */
+static int construct_group(char **tokens, command *cmd) {
+	int i, depth = 0;
+	for (i = 0; tokens[i]; i++) {
+		depth += nesting(tokens[i]);
+		if (depth == 0) {
+			break;
+		}
+	}
+	if (!tokens[i] || i == 1 ||
+	    strcmp(tokens[i], !strcmp(tokens[0], "{") ? "}" : ")")) {
+		fprintf(stderr, "syntax error: unterminated %s\n", tokens[0]);
+		return -1;
+	}
+
+	/* Only redirections may follow the closing token */
+	simple_command redirections = { NULL, NULL, NULL, NULL, 0 };
+	if (extract_redirections(tokens + i + 1, &redirections) == -1) {
+		return -1;
+	}
+	int trailing = redirections.tokens[0] != NULL;
+	parser_free(redirections.tokens);
+	if (trailing) {
+		fprintf(stderr, "syntax error near '%s'\n", tokens[i + 1]);
+		return -1;
+	}
+	cmd->in = redirections.in;
+	cmd->out = redirections.out;
+	cmd->err = redirections.err;
+
+	strcpy(cmd->oper, tokens[0]);
+	tokens[i] = NULL;
+	cmd->cmd1 = construct_command(tokens + 1);
+	return cmd->cmd1 ? 0 : -1;
+}
+
 /* Construct command */
 command* construct_command(char** tokens) {
 
+	int split = split_point(tokens);
+
+	/* An empty side of ";" is no command at all: "a ;" is just "a" */
+	if (split != -1 && !strcmp(tokens[split], ";")) {
+		if (split == 0) {
+			return tokens[1] ? construct_command(tokens + 1) : NULL;
+		}
+		if (!tokens[split + 1]) {
+			tokens[split] = NULL;
+			return construct_command(tokens);
+		}
+	}
+	if (split > 0 && !strcmp(tokens[split], "&")) {
+		return construct_background(tokens, split);
+	}
+
+	if (split != -1 && (split == 0 || !tokens[split + 1])) {
+		fprintf(stderr, "syntax error near '%s'\n", tokens[split]);
+		return NULL;
+	}
+
 	/* Initialize a new command */	
-	command *cmd = malloc(sizeof(command));
-	cmd->cmd1 = NULL;
-	cmd->cmd2 = NULL;
-	cmd->scmd = NULL;
+	command *cmd = new_command();
+	if (!cmd) {
+		return NULL;
+	}
 
-	if (!is_complex_command(tokens)) {
+	if (split == -1 && nesting(tokens[0]) == 1) {
+		/* Group or subshell, then its redirections */
+		if (construct_group(tokens, cmd) == -1) {
+			discard_command(cmd);
+			return NULL;
+		}
+	}
+	else if (split == -1) {
 		
 		/* Simple command */
-		cmd->scmd = malloc(sizeof(simple_command));
+		cmd->scmd = parser_alloc(sizeof(simple_command));
+		if (!cmd->scmd) {
+			discard_command(cmd);
+			return NULL;
+		}
 		cmd->scmd->in = NULL;
 		cmd->scmd->out = NULL;
 		cmd->scmd->err = NULL;
@@ -162,37 +477,46 @@ command* construct_command(char** tokens) {
 		int err = extract_redirections(tokens, cmd->scmd);
 		if (err == -1) {
 			printf("Error extracting redirections!\n");	
+			discard_command(cmd);
 			return NULL;
 		}
 	}
 	else {
 		/* Complex command */
-		
-		char **t1 = tokens, **t2;
-		int i = 0;
-		while(tokens[i]) {
-			if(is_operator(tokens[i])) {
-				strncpy(cmd->oper, tokens[i], 2);
-				tokens[i] = NULL;
-				t2 = &(tokens[i+1]);
-				break;
-			}
-			i++;
-		}
+		strncpy(cmd->oper, tokens[split], sizeof(cmd->oper) - 1);
+		cmd->oper[sizeof(cmd->oper) - 1] = '\0';
+		tokens[split] = NULL;
 		
 		/* Recursively construct the rest of the commands */
-		cmd->cmd1 = construct_command(t1);
-		cmd->cmd2 = construct_command(t2);
+		cmd->cmd1 = construct_command(tokens);
+		cmd->cmd2 = construct_command(tokens + split + 1);
+		if (!cmd->cmd1 || !cmd->cmd2) {
+			discard_command(cmd);
+			return NULL;
+		}
 	}
 	
 	return cmd;
 }
 
+/* Construct a command with every node allocated from a (tokens and the
+ * words they point to are not copied); NULL on a syntax error or if the
+ * arena fills up. Nothing is shared between threads using their own
+ * arenas. */
+command *construct_command_in(char **tokens, arena *a) {
+	arena *outer = parse_arena;
+	parse_arena = a;
+	command *cmd = construct_command(tokens);
+	parse_arena = outer;
+	return cmd;
+}
+
 /* Release resources */
 void release_command(command *cmd) {
 	
-	if(cmd->scmd && cmd->scmd->tokens) {
+	if(cmd->scmd) {
 		free(cmd->scmd->tokens);
+		free(cmd->scmd);
 	}
 	if(cmd->cmd1) {
 		release_command(cmd->cmd1);
@@ -200,6 +524,7 @@ void release_command(command *cmd) {
 	if(cmd->cmd2) {
 		release_command(cmd->cmd2);		
 	}
+	free(cmd);
 }
 
 /* Print command */
@@ -246,3 +571,76 @@ void print_command(command *cmd, int level) {
 	
 }
 
+/* Append a string to a bounded buffer, keeping it NUL terminated */
+static size_t append_text(char *buf, size_t size, size_t len, const char *s) {
+	while (*s && len + 1 < size) {
+		buf[len++] = *s++;
+	}
+	if (size) {
+		buf[len] = '\0';
+	}
+	return len;
+}
+
+static size_t format_redirections(const char *in, const char *out,
+				  const char *err, char *buf, size_t size,
+				  size_t len) {
+	if (in) {
+		len = append_text(buf, size, len, " < ");
+		len = append_text(buf, size, len, in);
+	}
+	if (out && out == err) {
+		len = append_text(buf, size, len, " &> ");
+		return append_text(buf, size, len, out);
+	}
+	if (out) {
+		len = append_text(buf, size, len, " > ");
+		len = append_text(buf, size, len, out);
+	}
+	if (err) {
+		len = append_text(buf, size, len, " 2> ");
+		len = append_text(buf, size, len, err);
+	}
+	return len;
+}
+
+/* Render a command back into a single line of text */
+size_t format_command(command *cmd, char *buf, size_t size, size_t len) {
+
+	if (cmd->scmd) {
+		int i;
+		for (i = 0; cmd->scmd->tokens[i]; i++) {
+			if (i) {
+				len = append_text(buf, size, len, " ");
+			}
+			len = append_text(buf, size, len, cmd->scmd->tokens[i]);
+		}
+		return format_redirections(cmd->scmd->in, cmd->scmd->out,
+					   cmd->scmd->err, buf, size, len);
+	}
+
+	if (!strcmp(cmd->oper, "&")) {
+		len = format_command(cmd->cmd1, buf, size, len);
+		return append_text(buf, size, len, " &");
+	}
+
+	if (!cmd->cmd2) {
+		/* Group or subshell */
+		len = append_text(buf, size, len, cmd->oper);
+		len = append_text(buf, size, len, " ");
+		len = format_command(cmd->cmd1, buf, size, len);
+		len = append_text(buf, size, len,
+				  cmd->oper[0] == '{' ? "; }" : " )");
+		return format_redirections(cmd->in, cmd->out, cmd->err,
+					   buf, size, len);
+	}
+
+	len = format_command(cmd->cmd1, buf, size, len);
+	/* "a & ; b" reads as "a & b" */
+	if (strcmp(cmd->oper, ";") || strcmp(cmd->cmd1->oper, "&")) {
+		len = append_text(buf, size, len, " ");
+		len = append_text(buf, size, len, cmd->oper);
+	}
+	len = append_text(buf, size, len, " ");
+	return format_command(cmd->cmd2, buf, size, len);
+}
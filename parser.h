@@ -1,11 +1,26 @@
 #ifndef __PARSER_H__
 #define __PARSER_H__
 
+#include <stddef.h>
+
 #include "shell.h"
+#include "arena.h"
 
 /* Determine if a token is a special operator (like '|') */
 int is_operator(char *token); 
 
+/* Precedence of an operator token, -1 if it isn't one */
+int operator_precedence(const char *token);
+
+#define MAX_SHARDS 64
+
+/* Copies and order of a sharded edge ("|N|", or "|Nu|" unordered);
+ * returns N, or 0 if the edge isn't sharded */
+int shard_count(const char *edge, int *ordered);
+
+/* The operator token for a sharded edge, a string that is never freed */
+const char *shard_operator(int n, int ordered);
+
 /* Determine if a command is builtin */
 int is_builtin(char *token);
 
@@ -15,6 +30,9 @@ int is_relative(char* path);
 /* Determine if a command is complex (has an operator like pipe '|') */
 int is_complex_command(char **tokens);
 
+/* Skip a parenthesized command substitution starting at '(' */
+char *skip_substitution(char *p);
+
 /* Parse a line into its tokens */
 void parse_line(char *line, char **tokens);
 
@@ -24,10 +42,17 @@ int extract_redirections(char** tokens, simple_command* cmd);
 /* Construct command */
 command* construct_command(char** tokens);
 
+/* Construct a command with every node allocated from an arena; it is
+ * released by resetting the arena, not with release_command */
+command *construct_command_in(char **tokens, arena *a);
+
 /* Release resources */
 void release_command(command *cmd);
 
 /* Print command */
 void print_command(command *cmd, int level);
 
+/* Render a command back into a single line of text, appending at len */
+size_t format_command(command *cmd, char *buf, size_t size, size_t len);
+
 #endif
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pathcache.h"
+
+/**
+ * Cache of program names resolved through PATH.
+ *
+ * The script lookahead thread resolves each program it sees here, to
+ * know which binary to have the kernel read in, and a name that comes
+ * up again is not searched for again. Only names found in an absolute
+ * PATH directory are cached, and nothing past a relative one, so the
+ * working directory never matters. The cache belongs to one value of
+ * PATH and is emptied if PATH changes.
+ *
+ * It is only a prefetch hint: exec still searches PATH itself. A program
+ * resolved ahead of time can be shadowed before it runs, by an earlier
+ * line installing one of the same name earlier in PATH, and checking
+ * for that would take the same walk through PATH as execvp.
+ */
+
+#define PATH_BUCKETS 256
+
+typedef struct path_entry {
+	char *name;
+	char *path;           /* Full path of the binary */
+	struct path_entry *next;
+} path_entry;
+
+static path_entry *entries[PATH_BUCKETS];
+static char *cache_path;       /* The PATH value entries were resolved in */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned path_hash(const char *s) {
+	unsigned h = 2166136261u;
+	while (*s) {
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h % PATH_BUCKETS;
+}
+
+/* Entry for a name, with the lock held */
+static path_entry *find_entry(const char *name) {
+	path_entry *e;
+	for (e = entries[path_hash(name)]; e; e = e->next) {
+		if (!strcmp(e->name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Make the cache belong to path, emptying it if it belonged to another,
+ * with the lock held */
+static void use_path(const char *path) {
+	int i;
+	if (cache_path && !strcmp(cache_path, path)) {
+		return;
+	}
+	for (i = 0; i < PATH_BUCKETS; i++) {
+		while (entries[i]) {
+			path_entry *e = entries[i];
+			entries[i] = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+	}
+	free(cache_path);
+	cache_path = strdup(path);
+}
+
+/* Search the PATH directories, as execvp would; returns 0 if found in an
+ * absolute one */
+static int search_path(const char *name, const char *path, char *buf,
+		       size_t size) {
+	const char *dir = path, *end;
+	struct stat st;
+
+	for (; *dir; dir = *end ? end + 1 : end) {
+		end = strchrnul(dir, ':');
+		if (dir[0] != '/') {
+			/* Relative to the working directory: don't cache
+			 * anything at all past it */
+			return -1;
+		}
+		if (snprintf(buf, size, "%.*s/%s", (int)(end - dir), dir,
+			     name) >= (int)size) {
+			continue;
+		}
+		if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(buf, X_OK) == 0) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Resolve a program name against a PATH value and cache the result */
+int path_resolve(const char *name, const char *path, char *buf, size_t size) {
+	pthread_mutex_lock(&cache_lock);
+	use_path(path);
+	path_entry *e = find_entry(name);
+	if (e) {
+		snprintf(buf, size, "%s", e->path);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	if (e) {
+		return 0;
+	}
+
+	/* Search without the lock */
+	if (search_path(name, path, buf, size) == -1) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	if (!strcmp(cache_path, path) && !find_entry(name)) {
+		e = malloc(sizeof(path_entry));
+		e->name = strdup(name);
+		e->path = strdup(buf);
+		e->next = entries[path_hash(name)];
+		entries[path_hash(name)] = e;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return 1;
+}
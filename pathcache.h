@@ -0,0 +1,11 @@
+#ifndef __PATHCACHE_H__
+#define __PATHCACHE_H__
+
+#include <stddef.h>
+
+/* Resolve a program name against a PATH value and cache the result, with
+ * its full path copied to buf. Returns 1 if it was newly resolved, 0 if
+ * it was cached already, -1 if it isn't found. */
+int path_resolve(const char *name, const char *path, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "pipeline.h"
+#include "parser.h"
+#include "options.h"
+#include "expand.h"
+#include "shard.h"
+
+/**
+ * Pipeline executor.
+ *
+ * A pipeline is flattened into its stages, and every stage is forked
+ * directly by the shell: no intermediate shell processes sit between
+ * them holding pipe ends open. Pipes are created close-on-exec and the
+ * shell drops each end as soon as the stages that use it exist, so the
+ * only holders of a pipe are the two stages it connects.
+ *
+ * Run from the shell itself, the stages share a new process group,
+ * which gets the terminal when the shell is interactive. Nested
+ * pipelines (in a watch-run, or a function in a pipeline) stay in their
+ * enclosing group, so signalling that group still reaches them.
+ *
+ * Stages are reaped in the order they exit, through pidfds. With
+ * set -o pipekill (SIGPIPE) or set -o pipeterm (SIGTERM), a stage that
+ * exits takes every stage upstream of it down at once, instead of them
+ * running until their next write into a pipe nobody reads.
+ *
+ * $? is the status of the last stage, or with set -o pipefail the status
+ * of the last stage that failed. PIPESTATUS holds every stage's status.
+ */
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Flatten a pipeline into stages (if not NULL); returns how many */
+int pipeline_stages(command *c, stage *stages) {
+	int n = 0;
+	const char *pipe = NULL;
+	while (!c->scmd && operator_precedence(c->oper) == 2) {
+		if (stages) {
+			memset(&stages[n], 0, sizeof(stage));
+			stages[n].cmd = c->cmd1;
+			stages[n].pipe = pipe;
+		}
+		n++;
+		pipe = c->oper;
+		c = c->cmd2;
+	}
+	if (stages) {
+		memset(&stages[n], 0, sizeof(stage));
+		stages[n].cmd = c;
+		stages[n].pipe = pipe;
+	}
+	return n + 1;
+}
+
+/* Program name of a stage, for meter labels */
+static const char *stage_name(command *c) {
+	while (!c->scmd) {
+		c = c->cmd1;
+	}
+	return c->scmd->tokens[0] ? c->scmd->tokens[0] : "";
+}
+
+/* Fork every stage, each reading from the previous edge (or its relay).
+ * Returns how many were started. */
+static int start_stages(stage *st, int n, meter_stats *edges,
+			pid_t *relays, int group) {
+	pid_t pgid = 0;
+	int i, in = -1;
+
+	fflush(stdout);
+	for (i = 0; i < n; i++) {
+		int pfd[2] = { -1, -1 };
+		if (i < n - 1 && pipe2(pfd, O_CLOEXEC) == -1) {
+			perror("pipe");
+			break;
+		}
+		st[i].start = now_ns();
+		st[i].pid = fork();
+		if (st[i].pid == 0) {
+			if (group) {
+				setpgid(0, pgid);
+				signal(SIGTTOU, SIG_DFL);
+			}
+			if (in != -1) {
+				dup2(in, STDIN_FILENO);
+				close(in);
+			}
+			if (pfd[1] != -1) {
+				dup2(pfd[1], STDOUT_FILENO);
+				close(pfd[0]);
+				close(pfd[1]);
+			}
+			int copies, ordered;
+			if ((copies = shard_count(st[i].pipe, &ordered))) {
+				run_shards(st[i].cmd, copies, ordered);
+			}
+			execute_complex_command(st[i].cmd);
+			exit(0);
+		}
+		if (in != -1) {
+			close(in);
+			in = -1;
+		}
+		if (st[i].pid == -1) {
+			perror("fork");
+			if (pfd[0] != -1) {
+				close(pfd[0]);
+				close(pfd[1]);
+			}
+			break;
+		}
+
+		/* Set the group from both sides, whichever runs first */
+		if (group) {
+			if (!pgid) {
+				pgid = st[i].pid;
+			}
+			setpgid(st[i].pid, pgid);
+			if (i == 0 && shell_interactive) {
+				tcsetpgrp(STDIN_FILENO, pgid);
+			}
+		}
+		st[i].pidfd = syscall(SYS_pidfd_open, st[i].pid, 0);
+
+		if (pfd[0] == -1) {
+			continue;
+		}
+		close(pfd[1]);
+		in = pfd[0];
+		/* A metered edge ("|!" or set -o pipemeter) gets a relay,
+		 * and the next stage reads from the relay instead */
+		if (edges || !strcmp(st[i + 1].pipe, "|!") ||
+		    shell_options[OPTION_PIPEMETER]) {
+			char label[256];
+			snprintf(label, sizeof(label), "%s -> %s",
+				 stage_name(st[i].cmd), stage_name(st[i + 1].cmd));
+			relays[i] = start_meter(pfd[0], label, &in,
+						edges ? &edges[i] : NULL);
+			if (relays[i] == -1) {
+				in = pfd[0];
+			}
+		}
+	}
+	return i;
+}
+
+/* Record the exit of stage i, taking the stages upstream of it down if
+ * the shell is set to */
+static void stage_exited(stage *st, int i, int status) {
+	int j, sig = shell_options[OPTION_PIPETERM] ? SIGTERM :
+		     shell_options[OPTION_PIPEKILL] ? SIGPIPE : 0;
+
+	st[i].end = now_ns();
+	st[i].status = WIFSIGNALED(status) ?
+		128 + WTERMSIG(status) : WEXITSTATUS(status);
+	st[i].pid = -1;
+	if (st[i].pidfd != -1) {
+		close(st[i].pidfd);
+		st[i].pidfd = -1;
+	}
+	for (j = 0; sig && j < i; j++) {
+		if (st[j].pid > 0) {
+			kill(st[j].pid, sig);
+		}
+	}
+}
+
+/* Reap the stages in the order they exit */
+static void reap_stages(stage *st, int n) {
+	struct pollfd *pfds = calloc(n, sizeof(struct pollfd));
+	int i, left, status;
+
+	do {
+		for (i = left = 0; i < n; i++) {
+			if (st[i].pidfd != -1) {
+				pfds[left].fd = st[i].pidfd;
+				pfds[left++].events = POLLIN;
+			}
+		}
+		if (left && poll(pfds, left, -1) == -1 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (st[i].pidfd != -1 &&
+			    wait4(st[i].pid, &status, WNOHANG, &st[i].ru) == st[i].pid) {
+				stage_exited(st, i, status);
+			}
+		}
+	} while (left);
+
+	/* Without pidfds, fall back to waiting in order */
+	for (i = 0; i < n; i++) {
+		if (st[i].pid > 0 && wait4(st[i].pid, &status, 0, &st[i].ru) > 0) {
+			stage_exited(st, i, status);
+		}
+	}
+	free(pfds);
+}
+
+/* Append a stage's status, and a 0 for each cat removed around it */
+int stage_statuses(command *c, int status, int *statuses, int n) {
+	int i, total = c->elided_before + 1 + c->elided_after;
+	for (i = 0; i < total && n < MAX_PIPESTATUS; i++) {
+		statuses[n++] = i == c->elided_before ? status : 0;
+	}
+	return n;
+}
+
+/* Run the stages as sibling children in one process group and wait for
+ * them. With edges (in shared memory), every edge is metered into it.
+ * Sets $? and PIPESTATUS, and returns $?. */
+int run_stages(stage *st, int n, meter_stats *edges) {
+	pid_t *relays = calloc(n, sizeof(pid_t));
+	int i, group = getpid() == shell_pid;
+
+	int started = start_stages(st, n, edges, relays, group);
+	reap_stages(st, started);
+	for (i = 0; i < n; i++) {
+		if (relays[i] > 0) {
+			waitpid(relays[i], NULL, 0);
+		}
+	}
+	if (group && started && shell_interactive) {
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+	}
+	free(relays);
+
+	/* $? is the last stage's status, or with pipefail the last failing
+	 * one's; PIPESTATUS keeps them all */
+	int statuses[MAX_PIPESTATUS], nstatuses = 0;
+	int status = started < n ? 1 : st[n - 1].cmd->elided_after ? 0 :
+		     st[n - 1].status;
+	for (i = 0; i < started; i++) {
+		if (shell_options[OPTION_PIPEFAIL] && st[i].status) {
+			status = st[i].status;
+		}
+		nstatuses = stage_statuses(st[i].cmd, st[i].status, statuses,
+					   nstatuses);
+	}
+	set_status(status, statuses, nstatuses);
+	return status;
+}
+
+/* Run a pipeline, returns its status ($?) */
+int execute_pipeline(command *c) {
+	int n = pipeline_stages(c, NULL);
+	stage *st = malloc(n * sizeof(stage));
+	pipeline_stages(c, st);
+	int status = run_stages(st, n, NULL);
+	free(st);
+	return status;
+}
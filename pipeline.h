@@ -0,0 +1,38 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <stdint.h>
+
+#include "shell.h"
+#include "meter.h"
+
+/* One stage of a flattened pipeline, and what became of it */
+typedef struct stage {
+	command *cmd;
+	const char *pipe;                /* Edge into this stage, or NULL */
+	pid_t pid;
+	int pidfd;
+	int status;
+	uint64_t start, end;             /* Fork and reap times, in ns */
+	struct rusage ru;
+} stage;
+
+/* Flatten a pipeline into stages (if not NULL); returns how many */
+int pipeline_stages(command *c, stage *stages);
+
+/* Run the stages as sibling children in one process group and wait for
+ * them. With edges (in shared memory), every edge is metered into it.
+ * Sets $? and PIPESTATUS, and returns $?. */
+int run_stages(stage *stages, int n, meter_stats *edges);
+
+/* Append a stage's status to statuses (n of them so far), with a 0
+ * around it for each cat stage the optimizer removed; returns the new
+ * count */
+int stage_statuses(command *c, int status, int *statuses, int n);
+
+/* Run a pipeline, returns its status ($?) */
+int execute_pipeline(command *c);
+
+#endif
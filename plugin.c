@@ -0,0 +1,173 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+
+#include "plugin.h"
+#include "parser.h"
+#include "myshell_builtin.h"
+
+/**
+ * Loadable builtins.
+ *
+ * "enable -f lib.so name" opens the library and looks up the symbol
+ * name_builtin, a struct myshell_builtin (see myshell_builtin.h). From
+ * then on is_builtin knows the name, and the command runs in-process
+ * like any other builtin: no fork, no exec, even as a pipeline stage.
+ * Its redirections are opened for the call and handed over as plain
+ * descriptors, since a plugin shares no stdio state with the shell.
+ */
+
+typedef struct loadable_t {
+	const struct myshell_builtin *builtin;
+	void *library;
+	char *path;
+	struct loadable_t *next;
+} loadable;
+
+static loadable *loadables;
+
+static const struct myshell_builtin *find_loadable(const char *name) {
+	loadable *l;
+	for (l = loadables; l; l = l->next) {
+		if (!strcmp(l->builtin->name, name)) {
+			return l->builtin;
+		}
+	}
+	return NULL;
+}
+
+/* Determine if a loadable builtin of this name has been enabled */
+int is_loadable(const char *name) {
+	return find_loadable(name) != NULL;
+}
+
+/* Open a redirection for a builtin, or return the default descriptor */
+static int open_redirection(const char *file, int flags, int fd) {
+	if (!file) {
+		return fd;
+	}
+	int opened = open(file, flags, 0664);
+	if (opened == -1) {
+		perror(file);
+	}
+	return opened;
+}
+
+/* Run an enabled loadable builtin in this process */
+int run_loadable(simple_command *cmd) {
+	const struct myshell_builtin *b = find_loadable(cmd->tokens[0]);
+	if (!b) {
+		fprintf(stderr, "%s: builtin is not enabled\n", cmd->tokens[0]);
+		return 127;
+	}
+
+	struct myshell_command c = { MYSHELL_BUILTIN_ABI, 0, cmd->tokens,
+				     STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	while (cmd->tokens[c.argc]) {
+		c.argc++;
+	}
+	int status = EXIT_FAILURE;
+	c.in = open_redirection(cmd->in, O_RDONLY, STDIN_FILENO);
+	c.out = open_redirection(cmd->out, O_CREAT | O_WRONLY | O_TRUNC,
+				 STDOUT_FILENO);
+	c.err = cmd->err && cmd->err == cmd->out ? c.out :
+		open_redirection(cmd->err, O_CREAT | O_WRONLY | O_TRUNC,
+				 STDERR_FILENO);
+
+	if (c.in != -1 && c.out != -1 && c.err != -1) {
+		/* The plugin writes to descriptors; ours must go first */
+		fflush(stdout);
+		fflush(stderr);
+		status = b->run(&c);
+	}
+
+	if (c.in > STDERR_FILENO) {
+		close(c.in);
+	}
+	if (c.out > STDERR_FILENO) {
+		close(c.out);
+	}
+	if (c.err > STDERR_FILENO && c.err != c.out) {
+		close(c.err);
+	}
+	return status;
+}
+
+/* Load the builtin called name from an opened library */
+static int enable_builtin(void *library, const char *path, const char *name) {
+	char symbol[256];
+	snprintf(symbol, sizeof(symbol), "%s_builtin", name);
+	const struct myshell_builtin *b = dlsym(library, symbol);
+	if (!b) {
+		fprintf(stderr, "enable: %s: no %s in %s\n", name, symbol, path);
+		return -1;
+	}
+	if (b->abi != MYSHELL_BUILTIN_ABI || !b->run || !b->name ||
+	    strcmp(b->name, name)) {
+		fprintf(stderr, "enable: %s: built for ABI %d, not %d\n",
+			name, b->abi, MYSHELL_BUILTIN_ABI);
+		return -1;
+	}
+	if (is_builtin((char *)name) && !is_loadable(name)) {
+		fprintf(stderr, "enable: %s: shadows a shell builtin\n", name);
+		return -1;
+	}
+
+	/* Replace an older definition of the same name */
+	loadable **p;
+	for (p = &loadables; *p; p = &(*p)->next) {
+		if (!strcmp((*p)->builtin->name, name)) {
+			loadable *old = *p;
+			*p = old->next;
+			free(old->path);
+			free(old);
+			break;
+		}
+	}
+	loadable *l = malloc(sizeof(loadable));
+	l->builtin = b;
+	l->library = library;
+	l->path = strdup(path);
+	l->next = loadables;
+	loadables = l;
+	return 0;
+}
+
+/**
+ * enable -f library name...: loads builtins from a shared library.
+ * Without arguments, lists the loaded builtins.
+ */
+int execute_enable(char **words) {
+	loadable *l;
+
+	if (!words[1]) {
+		for (l = loadables; l; l = l->next) {
+			printf("%-16s %s  (%s)\n", l->builtin->name,
+			       l->builtin->usage ? l->builtin->usage : "",
+			       l->path);
+		}
+		return EXIT_SUCCESS;
+	}
+	if (strcmp(words[1], "-f") || !words[2] || !words[3]) {
+		fprintf(stderr, "usage: enable [-f library name...]\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Libraries stay loaded: plans may still refer to their builtins */
+	void *library = dlopen(words[2], RTLD_NOW | RTLD_LOCAL);
+	if (!library) {
+		fprintf(stderr, "enable: %s\n", dlerror());
+		return EXIT_FAILURE;
+	}
+	int i, status = EXIT_SUCCESS;
+	for (i = 3; words[i]; i++) {
+		if (enable_builtin(library, words[2], words[i]) == -1) {
+			status = EXIT_FAILURE;
+		}
+	}
+	return status;
+}
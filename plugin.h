@@ -0,0 +1,15 @@
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+#include "shell.h"
+
+/* Determine if a loadable builtin of this name has been enabled */
+int is_loadable(const char *name);
+
+/* Run an enabled loadable builtin in this process */
+int run_loadable(simple_command *cmd);
+
+/* Builtin: enable [-f library name...] */
+int execute_enable(char **words);
+
+#endif
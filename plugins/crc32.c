@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../myshell_builtin.h"
+
+/**
+ * Example loadable builtin: crc32 [file...], prints the CRC-32 of each
+ * file, or of its input. Build with "make plugins", then
+ *     enable -f plugins/crc32.so crc32
+ */
+
+static uint32_t table[256];
+
+static void crc32_init(void) {
+	uint32_t i, j, c;
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++) {
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+}
+
+static int crc32_fd(int fd, uint32_t *crc) {
+	unsigned char buf[64 * 1024];
+	uint32_t c = 0xffffffffu;
+	ssize_t n, i;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			c = table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+		}
+	}
+	*crc = c ^ 0xffffffffu;
+	return n == 0 ? 0 : -1;
+}
+
+static int crc32_run(const struct myshell_command *cmd) {
+	uint32_t crc;
+	int i, status = 0;
+
+	if (!table[1]) {
+		crc32_init();
+	}
+	if (cmd->argc == 1) {
+		if (crc32_fd(cmd->in, &crc) == -1) {
+			dprintf(cmd->err, "crc32: read error\n");
+			return 1;
+		}
+		dprintf(cmd->out, "%08x\n", crc);
+		return 0;
+	}
+	for (i = 1; i < cmd->argc; i++) {
+		int fd = open(cmd->argv[i], O_RDONLY);
+		if (fd == -1 || crc32_fd(fd, &crc) == -1) {
+			dprintf(cmd->err, "crc32: %s: cannot read\n", cmd->argv[i]);
+			status = 1;
+		}
+		else {
+			dprintf(cmd->out, "%08x  %s\n", crc, cmd->argv[i]);
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	return status;
+}
+
+struct myshell_builtin crc32_builtin = {
+	MYSHELL_BUILTIN_ABI, "crc32", crc32_run, "crc32 [file...]"
+};
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "cmdlog.h"
+
+/**
+ * Script profiler: shell --profile script.sh.
+ *
+ * Every line the shell runs is charged with the wall time it took, the
+ * CPU time of the shell and of the children it waited for, and the forks
+ * made meanwhile. Each fork bumps a counter in memory shared with every
+ * descendant of the shell (from a pthread_atfork handler), so stages,
+ * subshells and the forks inside them all count; forks made by other
+ * programs don't. A line that runs a function is charged for the whole
+ * call.
+ *
+ * At exit, SCRIPT.profile lists the lines that ran, costliest wall time
+ * first, and SCRIPT.annotated is the script with each line's figures in
+ * front of it. Work the shell waits for later (background jobs, lines
+ * running under set -o autoparallel) is charged to the line that was
+ * running when it was reaped.
+ */
+
+#define PROFILE_TEXT 60          /* Characters of a line in the report */
+
+typedef struct line_profile {
+	int runs;                /* 0 if it never ran */
+	uint64_t wall, cpu;      /* ns */
+	uint64_t forks;
+} line_profile;
+
+static const char *profile_script;
+static line_profile *lines;
+static int nlines;
+static uint64_t *forks;          /* Shared with every descendant */
+
+/* Where the current line started */
+static int current;
+static uint64_t start_wall, start_cpu, start_forks;
+
+static void count_fork(void) {
+	__atomic_fetch_add(forks, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t cpu_ns(void) {
+	struct rusage self, children;
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	return (self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+		children.ru_utime.tv_sec + children.ru_stime.tv_sec) *
+	       1000000000ull +
+	       (self.ru_utime.tv_usec + self.ru_stime.tv_usec +
+		children.ru_utime.tv_usec + children.ru_stime.tv_usec) * 1000ull;
+}
+
+/* Start profiling a script's lines; returns -1 if it can't */
+int profile_start(const char *script) {
+	forks = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (forks == MAP_FAILED) {
+		forks = NULL;
+		return -1;
+	}
+	pthread_atfork(NULL, NULL, count_fork);
+	profile_script = script;
+	return 0;
+}
+
+void profile_begin(int lineno, const char *line) {
+	line += strspn(line, " \t");
+	if (!profile_script || !*line || *line == '#') {
+		/* Nothing to run, nothing to charge */
+		current = 0;
+		return;
+	}
+	if (lineno >= nlines) {
+		int n = lineno * 2 + 64;
+		lines = realloc(lines, n * sizeof(line_profile));
+		memset(lines + nlines, 0, (n - nlines) * sizeof(line_profile));
+		nlines = n;
+	}
+	current = lineno;
+	start_forks = __atomic_load_n(forks, __ATOMIC_RELAXED);
+	start_cpu = cpu_ns();
+	start_wall = cmdlog_now();
+}
+
+void profile_end(void) {
+	if (!current) {
+		return;
+	}
+	line_profile *p = &lines[current];
+	p->wall += cmdlog_now() - start_wall;
+	p->cpu += cpu_ns() - start_cpu;
+	p->forks += __atomic_load_n(forks, __ATOMIC_RELAXED) - start_forks;
+	p->runs++;
+}
+
+static int by_wall(const void *a, const void *b) {
+	const line_profile *x = &lines[*(const int *)a];
+	const line_profile *y = &lines[*(const int *)b];
+	return x->wall < y->wall ? 1 : x->wall > y->wall ? -1 :
+	       *(const int *)a - *(const int *)b;
+}
+
+/* The script's lines, read back from the file; *n is how many */
+static char **read_script(int *n) {
+	FILE *f = fopen(profile_script, "r");
+	char **text = NULL, *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	*n = 0;
+	if (!f) {
+		return NULL;
+	}
+	while ((len = getline(&line, &cap, f)) != -1) {
+		if (len > 0 && line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		text = realloc(text, (*n + 1) * sizeof(char *));
+		text[(*n)++] = strdup(line);
+	}
+	free(line);
+	fclose(f);
+	return text;
+}
+
+static FILE *open_output(const char *suffix, char *path, size_t size) {
+	snprintf(path, size, "%s.%s", profile_script, suffix);
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+	}
+	return f;
+}
+
+/* Write the sorted report and the annotated script */
+void profile_finish(void) {
+	char path[4096];
+	int *order, n = 0, ntext, i;
+	uint64_t wall = 0, cpu = 0, total_forks = 0;
+
+	if (!profile_script) {
+		return;
+	}
+	char **text = read_script(&ntext);
+	order = malloc((nlines + 1) * sizeof(int));
+	for (i = 1; i < nlines; i++) {
+		if (lines[i].runs) {
+			order[n++] = i;
+			wall += lines[i].wall;
+			cpu += lines[i].cpu;
+			total_forks += lines[i].forks;
+		}
+	}
+	qsort(order, n, sizeof(int), by_wall);
+
+	FILE *f = open_output("profile", path, sizeof(path));
+	if (f) {
+		fprintf(f, "# %s: %.3f s wall, %.3f s cpu, %lu forks\n",
+			profile_script, wall / 1e9, cpu / 1e9,
+			(unsigned long)total_forks);
+		fprintf(f, "#  line     wall s  %%wall      cpu s   forks  command\n");
+		for (i = 0; i < n; i++) {
+			line_profile *p = &lines[order[i]];
+			const char *t = order[i] <= ntext ? text[order[i] - 1] : "";
+			fprintf(f, "%7d %10.3f %5.1f%% %10.3f %7lu  %.*s\n",
+				order[i], p->wall / 1e9,
+				wall ? 100.0 * p->wall / wall : 0.0, p->cpu / 1e9,
+				(unsigned long)p->forks, PROFILE_TEXT,
+				t + strspn(t, " \t"));
+		}
+		fclose(f);
+		fprintf(stderr, "profile: %s\n", path);
+	}
+
+	f = open_output("annotated", path, sizeof(path));
+	if (f) {
+		fprintf(f, "%10s %10s %7s | %s\n", "wall s", "cpu s", "forks",
+			profile_script);
+		for (i = 0; i < ntext; i++) {
+			line_profile *p = i + 1 < nlines ? &lines[i + 1] : NULL;
+			if (p && p->runs) {
+				fprintf(f, "%10.3f %10.3f %7lu | %s\n", p->wall / 1e9,
+					p->cpu / 1e9, (unsigned long)p->forks,
+					text[i]);
+			}
+			else {
+				fprintf(f, "%10s %10s %7s | %s\n", "", "", "", text[i]);
+			}
+		}
+		fclose(f);
+		fprintf(stderr, "profile: %s\n", path);
+	}
+
+	for (i = 0; i < ntext; i++) {
+		free(text[i]);
+	}
+	free(text);
+	free(order);
+}
@@ -0,0 +1,15 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+/* Start profiling a script's lines; returns -1 if it can't */
+int profile_start(const char *script);
+
+/* Bracket the execution of script line lineno, the text given (no-ops
+ * unless profiling) */
+void profile_begin(int lineno, const char *line);
+void profile_end(void);
+
+/* Write the sorted report and the annotated script */
+void profile_finish(void);
+
+#endif
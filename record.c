@@ -0,0 +1,315 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "record.h"
+#include "shell.h"
+
+/**
+ * Session recording and replay.
+ *
+ * A recording is a small header followed by one record per input line:
+ *   varint  microseconds since the previous line
+ *   varint  length of the cwd, 0 if unchanged since the previous line
+ *   bytes   cwd
+ *   varint  length of the line
+ *   bytes   line
+ * Varints are unsigned LEB128, so a typical record costs a few bytes on
+ * top of the line itself.
+ */
+
+#define RECORD_MAGIC "MSHREC1"
+#define RECORD_MAGIC_LEN 8
+
+static FILE *record_file = NULL;
+static uint64_t record_last_us;
+static char *record_last_cwd = NULL;
+
+typedef struct replay_entry_t {
+	uint64_t offset_us;   /* Time since the start of the session */
+	char *cwd;            /* Working directory the line was typed in */
+	char *line;           /* The line itself */
+} replay_entry;
+
+static uint64_t now_us(int clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+/* Decode a varint, returns -1 if it runs past the end of the buffer */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		      uint64_t *v) {
+	int shift = 0;
+	*v = 0;
+	while (*p < end && shift < 64) {
+		unsigned char b = *(*p)++;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+/* Start recording every input line to a session file */
+int record_open(const char *path) {
+	record_file = fopen(path, "w");
+	if (!record_file) {
+		return -1;
+	}
+	uint64_t start = now_us(CLOCK_REALTIME);
+	fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_LEN, record_file);
+	fwrite(&start, sizeof(start), 1, record_file);
+	record_last_us = now_us(CLOCK_MONOTONIC);
+	return 0;
+}
+
+/* Append a line (with its timestamp and cwd) to the recording, if any */
+void record_line(const char *line) {
+	if (!record_file) {
+		return;
+	}
+	uint64_t t = now_us(CLOCK_MONOTONIC);
+	put_varint(record_file, t - record_last_us);
+	record_last_us = t;
+
+	char *cwd = getcwd(NULL, 0);
+	if (cwd && (!record_last_cwd || strcmp(cwd, record_last_cwd))) {
+		put_varint(record_file, strlen(cwd));
+		fputs(cwd, record_file);
+		free(record_last_cwd);
+		record_last_cwd = cwd;
+	}
+	else {
+		put_varint(record_file, 0);
+		free(cwd);
+	}
+
+	put_varint(record_file, strlen(line));
+	fputs(line, record_file);
+	/* Keep the file usable even if the shell is killed */
+	fflush(record_file);
+}
+
+/* Flush and close the recording */
+void record_close(void) {
+	if (record_file) {
+		fclose(record_file);
+		record_file = NULL;
+	}
+	free(record_last_cwd);
+	record_last_cwd = NULL;
+}
+
+/* Load a session file into an array of entries, returns the count or -1 */
+static int load_session(const char *path, replay_entry **entries,
+			size_t *longest) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < RECORD_MAGIC_LEN + 8) {
+		fprintf(stderr, "%s: not a session recording\n", path);
+		close(fd);
+		return -1;
+	}
+	unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				   fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if (memcmp(data, RECORD_MAGIC, RECORD_MAGIC_LEN)) {
+		fprintf(stderr, "%s: not a session recording\n", path);
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	const unsigned char *p = data + RECORD_MAGIC_LEN + 8;
+	const unsigned char *end = data + st.st_size;
+	int n = 0, cap = 64;
+	uint64_t offset = 0;
+	char *cwd = NULL;
+	*entries = malloc(cap * sizeof(replay_entry));
+	*longest = 0;
+
+	while (p < end) {
+		uint64_t delta, cwdlen, linelen;
+		if (get_varint(&p, end, &delta) == -1 ||
+		    get_varint(&p, end, &cwdlen) == -1 ||
+		    (uint64_t)(end - p) < cwdlen) {
+			break;
+		}
+		if (cwdlen) {
+			cwd = strndup((const char *)p, cwdlen);
+			p += cwdlen;
+		}
+		if (get_varint(&p, end, &linelen) == -1 ||
+		    (uint64_t)(end - p) < linelen) {
+			break;
+		}
+		if (n == cap) {
+			cap *= 2;
+			*entries = realloc(*entries, cap * sizeof(replay_entry));
+		}
+		offset += delta;
+		(*entries)[n].offset_us = offset;
+		(*entries)[n].cwd = cwd;
+		(*entries)[n].line = strndup((const char *)p, linelen);
+		if (linelen > *longest) {
+			*longest = linelen;
+		}
+		p += linelen;
+		n++;
+	}
+	if (p < end) {
+		fprintf(stderr, "%s: truncated record after %d lines\n", path, n);
+	}
+	munmap(data, st.st_size);
+	return n;
+}
+
+/* Replay every entry in this process, storing per-line latencies */
+static void replay_worker(replay_entry *entries, int n, size_t longest,
+			  int paced, uint64_t *latency) {
+	char *line = malloc(longest + 1);
+	char *cwd = NULL;
+	uint64_t start = now_us(CLOCK_MONOTONIC);
+
+	/* Commands run for load, not for their output */
+	int devnull = open("/dev/null", O_RDWR);
+	if (devnull != -1) {
+		dup2(devnull, STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		close(devnull);
+	}
+
+	int i;
+	for (i = 0; i < n; i++) {
+		latency[i] = UINT64_MAX;
+	}
+	for (i = 0; i < n; i++) {
+		if (paced) {
+			uint64_t due = start + entries[i].offset_us;
+			struct timespec ts = { due / 1000000,
+					       (due % 1000000) * 1000 };
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+		if (entries[i].cwd && entries[i].cwd != cwd) {
+			chdir(entries[i].cwd);
+			cwd = entries[i].cwd;
+		}
+		strcpy(line, entries[i].line);
+
+		uint64_t t0 = now_us(CLOCK_MONOTONIC);
+		int exitcode = run_line(line, 0);
+		latency[i] = now_us(CLOCK_MONOTONIC) - t0;
+		if (exitcode == -1) {
+			break;
+		}
+	}
+	free(line);
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Replay a recorded session through one or more concurrent shell
+ * instances and report throughput and latency percentiles */
+int replay_session(const char *path, int instances, int paced) {
+	replay_entry *entries;
+	size_t longest;
+	int n = load_session(path, &entries, &longest);
+	if (n <= 0) {
+		return n;
+	}
+	if (instances < 1) {
+		instances = 1;
+	}
+
+	/* Workers report latencies through a shared mapping */
+	size_t size = (size_t)n * instances * sizeof(uint64_t);
+	uint64_t *latency = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latency == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	fflush(stdout);
+	uint64_t start = now_us(CLOCK_MONOTONIC);
+	int i;
+	for (i = 0; i < instances; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			instances = i;
+			break;
+		}
+		if (pid == 0) {
+			replay_worker(entries, n, longest, paced,
+				      latency + (size_t)i * n);
+			exit(0);
+		}
+	}
+	while (wait(NULL) > 0)
+		;
+	uint64_t wall = now_us(CLOCK_MONOTONIC) - start;
+
+	/* Compact executed lines to the front and sort them */
+	size_t done = 0, k;
+	for (k = 0; k < (size_t)n * instances; k++) {
+		if (latency[k] != UINT64_MAX) {
+			latency[done++] = latency[k];
+		}
+	}
+	qsort(latency, done, sizeof(uint64_t), compare_u64);
+
+	printf("replayed %zu commands (%d lines x %d instances) in %.3f s\n",
+	       done, n, instances, wall / 1e6);
+	if (done) {
+		printf("throughput: %.1f commands/s\n", done * 1e6 / wall);
+		printf("latency us: p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  "
+		       "max %lu\n",
+		       (unsigned long)latency[done * 50 / 100],
+		       (unsigned long)latency[done * 90 / 100],
+		       (unsigned long)latency[done * 99 / 100],
+		       (unsigned long)latency[done * 999 / 1000],
+		       (unsigned long)latency[done - 1]);
+	}
+
+	munmap(latency, size);
+	for (i = 0; i < n; i++) {
+		if (entries[i].cwd &&
+		    (i == 0 || entries[i].cwd != entries[i-1].cwd)) {
+			free(entries[i].cwd);
+		}
+		free(entries[i].line);
+	}
+	free(entries);
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+/* Start recording every input line to a session file */
+int record_open(const char *path);
+
+/* Append a line (with its timestamp and cwd) to the recording, if any */
+void record_line(const char *line);
+
+/* Flush and close the recording */
+void record_close(void);
+
+/* Replay a recorded session through one or more concurrent shell
+ * instances and report throughput and latency percentiles */
+int replay_session(const char *path, int instances, int paced);
+
+#endif
@@ -0,0 +1,429 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shard.h"
+#include "expand.h"
+
+/**
+ * Sharded stages: "producer |8| transform | consumer".
+ *
+ * The stage after a sharded edge runs as N copies under a coordinator,
+ * which is the stage's process as far as the pipeline is concerned. The
+ * coordinator cuts its input into chunks of whole lines, hands them out
+ * to the copies and merges what they write back into its own stdout.
+ *
+ * "|N|" keeps the input order. Every chunk (up to SHARD_CHUNK) gets a
+ * process of its own, at most N at a time, with its sequence number.
+ * The oldest chunk's output streams straight through; later chunks'
+ * output is held until their turn. "|Nu|" is unordered: N long-lived
+ * copies take smaller chunks (SHARD_BLOCK), each going to the idle copy
+ * with the least input still queued in its pipe. Their output is merged
+ * a whole line at a time, in whatever order it comes.
+ *
+ * Either way the stage has to treat every line on its own, as the
+ * chunks are split arbitrarily. The stage's own redirections apply to
+ * the coordinator, so "|4| sort > out" writes the merged output there.
+ */
+
+#define SHARD_CHUNK (1024 * 1024)        /* Bytes per process, ordered */
+#define SHARD_BLOCK (64 * 1024)          /* Bytes per hand-out, unordered */
+
+/* One copy of the stage, and the coordinator's ends of its pipes */
+typedef struct copy {
+	pid_t pid;               /* 0 once reaped */
+	int pidfd;
+	int pending;             /* Output not all written out (ordered) */
+	int in, out;             /* Its stdin and stdout, -1 once closed */
+	char *chunk;             /* Lines being written to it */
+	size_t len, off;
+	long seq;                /* Chunk number (ordered) */
+	char *buf;               /* Output held for its turn (ordered), or
+				  * a partial line (unordered) */
+	size_t buf_len, buf_cap;
+} copy;
+
+static copy *copies;
+static int ncopies, failed;
+
+/* Input not yet handed out */
+static char *input;
+static size_t in_len, in_cap;
+static int in_eof, in_short;
+
+static void write_out(const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && errno == EPIPE) {
+			/* Nobody reads us any more: go the way a stage would */
+			signal(SIGPIPE, SIG_DFL);
+			raise(SIGPIPE);
+		}
+		if (n <= 0) {
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void buf_append(copy *cp, const char *data, size_t len) {
+	if (cp->buf_len + len > cp->buf_cap) {
+		cp->buf_cap = (cp->buf_len + len) * 2;
+		cp->buf = realloc(cp->buf, cp->buf_cap);
+	}
+	memcpy(cp->buf + cp->buf_len, data, len);
+	cp->buf_len += len;
+}
+
+static void read_input(void) {
+	if (in_cap - in_len < SHARD_BLOCK) {
+		in_cap = in_len + SHARD_BLOCK;
+		input = realloc(input, in_cap);
+	}
+	ssize_t n = read(STDIN_FILENO, input + in_len, SHARD_BLOCK);
+	if (n == -1 && errno == EINTR) {
+		return;
+	}
+	if (n <= 0) {
+		in_eof = 1;
+		return;
+	}
+	in_len += n;
+	in_short = n < SHARD_BLOCK;
+}
+
+/* Cut up to size bytes of whole lines off the input. Less than size
+ * only goes if nothing more is coming right now. NULL if there is no
+ * chunk to hand out yet. */
+static char *next_chunk(size_t size, size_t *len) {
+	size_t n = 0;
+	char *nl;
+
+	if (in_len >= size) {
+		nl = memrchr(input, '\n', size);
+		if (!nl) {
+			/* A line longer than a chunk goes whole */
+			nl = memchr(input + size, '\n', in_len - size);
+		}
+		n = nl ? (size_t)(nl + 1 - input) : in_eof ? in_len : 0;
+	}
+	else if (in_eof) {
+		n = in_len;
+	}
+	else if (in_short && (nl = memrchr(input, '\n', in_len))) {
+		n = nl + 1 - input;
+	}
+	if (!n) {
+		return NULL;
+	}
+
+	char *chunk = malloc(n);
+	memcpy(chunk, input, n);
+	memmove(input, input + n, in_len - n);
+	in_len -= n;
+	*len = n;
+	return chunk;
+}
+
+static void spawn_copy(copy *cp, command *c) {
+	int to[2], from[2], i;
+
+	if (pipe2(to, O_CLOEXEC) == -1 || pipe2(from, O_CLOEXEC) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	cp->pid = fork();
+	if (cp->pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (cp->pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		dup2(to[0], STDIN_FILENO);
+		dup2(from[1], STDOUT_FILENO);
+		close(to[0]);
+		close(to[1]);
+		close(from[0]);
+		close(from[1]);
+		/* Builtins don't exec: drop the other copies' pipes now */
+		for (i = 0; i < ncopies; i++) {
+			if (copies[i].in != -1) {
+				close(copies[i].in);
+			}
+			if (copies[i].out != -1) {
+				close(copies[i].out);
+			}
+		}
+		execute_complex_command(c);
+	}
+	close(to[0]);
+	close(from[1]);
+	cp->in = to[1];
+	cp->out = from[0];
+	cp->pidfd = syscall(SYS_pidfd_open, cp->pid, 0);
+	fcntl(cp->in, F_SETFL, O_NONBLOCK);
+}
+
+/* Reap a copy once it has exited, or right away without a pidfd */
+static void reap_copy(copy *cp) {
+	int status;
+	while (waitpid(cp->pid, &status, 0) == -1 && errno == EINTR)
+		;
+	if (cp->pidfd != -1) {
+		close(cp->pidfd);
+		cp->pidfd = -1;
+	}
+	cp->pid = 0;
+	status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) :
+		 WEXITSTATUS(status);
+	if (status && !failed) {
+		failed = status;
+	}
+}
+
+/* Write as much of a copy's chunk as its pipe takes */
+static void feed(copy *cp) {
+	ssize_t n = write(cp->in, cp->chunk + cp->off, cp->len - cp->off);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n == -1) {
+		/* It stopped reading: the rest of the chunk is lost on it */
+		n = cp->len - cp->off;
+	}
+	cp->off += n;
+	if (cp->off == cp->len) {
+		free(cp->chunk);
+		cp->chunk = NULL;
+	}
+}
+
+/* Ordered: start a process for each chunk while there are free slots */
+static void dispatch_ordered(command *c, long *next_seq) {
+	int i;
+	for (i = 0; i < ncopies; i++) {
+		if (copies[i].pid || copies[i].pending) {
+			continue;
+		}
+		char *chunk = next_chunk(SHARD_CHUNK, &copies[i].len);
+		if (!chunk) {
+			return;
+		}
+		spawn_copy(&copies[i], c);
+		copies[i].chunk = chunk;
+		copies[i].off = 0;
+		copies[i].seq = (*next_seq)++;
+		copies[i].pending = 1;
+	}
+}
+
+/* Ordered: write out the oldest chunks' output, as far as it's done */
+static void emit_ordered(long *emit_seq) {
+	int i, moved;
+	do {
+		moved = 0;
+		for (i = 0; i < ncopies; i++) {
+			copy *cp = &copies[i];
+			if (!cp->pending || cp->seq != *emit_seq) {
+				continue;
+			}
+			write_out(cp->buf, cp->buf_len);
+			cp->buf_len = 0;
+			if (cp->out == -1) {
+				/* Done: the next chunk's turn */
+				cp->pending = 0;
+				(*emit_seq)++;
+				moved = 1;
+			}
+		}
+	} while (moved);
+}
+
+/* Unordered: hand chunks to idle copies, least queued input first */
+static void dispatch_unordered(void) {
+	for (;;) {
+		int i, best = -1, queued, least = 0;
+		for (i = 0; i < ncopies; i++) {
+			if (copies[i].in == -1 || copies[i].chunk) {
+				continue;
+			}
+			if (ioctl(copies[i].in, FIONREAD, &queued) == -1) {
+				queued = 0;
+			}
+			if (best == -1 || queued < least) {
+				best = i;
+				least = queued;
+			}
+		}
+		if (best == -1) {
+			return;
+		}
+		copy *cp = &copies[best];
+		cp->chunk = next_chunk(SHARD_BLOCK, &cp->len);
+		if (!cp->chunk) {
+			return;
+		}
+		cp->off = 0;
+		feed(cp);
+	}
+}
+
+/* Run a stage as N copies over stdin and stdout */
+void run_shards(command *c, int n, int ordered) {
+	long next_seq = 0, emit_seq = 0;
+	int i;
+
+	/* The stage's redirections are for the merged stream, not each copy */
+	char **in = c->scmd ? &c->scmd->in : &c->in;
+	char **out = c->scmd ? &c->scmd->out : &c->out;
+	char **err = c->scmd ? &c->scmd->err : &c->err;
+	expansion e;
+	memset(&e, 0, sizeof(e));
+	if (apply_redirections(expand_word(*in, &e), expand_word(*out, &e),
+			       expand_word(*err, &e)) == -1) {
+		exit(EXIT_FAILURE);
+	}
+	*in = *out = *err = NULL;
+
+	/* A copy that stops reading is no reason for us to die */
+	signal(SIGPIPE, SIG_IGN);
+	ncopies = n;
+	copies = calloc(n, sizeof(copy));
+	for (i = 0; i < n; i++) {
+		copies[i].in = copies[i].out = copies[i].pidfd = -1;
+	}
+	for (i = 0; !ordered && i < n; i++) {
+		spawn_copy(&copies[i], c);
+	}
+
+	struct pollfd *pfds = calloc(2 * n + 1, sizeof(struct pollfd));
+	copy **owner = calloc(2 * n + 1, sizeof(copy *));
+	for (;;) {
+		if (ordered) {
+			dispatch_ordered(c, &next_seq);
+		}
+		else {
+			dispatch_unordered();
+		}
+
+		/* A copy with nothing more coming gets its EOF */
+		int input_done = in_eof && in_len == 0;
+		for (i = 0; i < n; i++) {
+			copy *cp = &copies[i];
+			if (cp->in != -1 && !cp->chunk && (ordered || input_done)) {
+				close(cp->in);
+				cp->in = -1;
+			}
+		}
+
+		int nfds = 0, busy = 0;
+		size_t limit = ordered ? SHARD_CHUNK : SHARD_BLOCK;
+		if (!in_eof && (in_len < limit || !memchr(input, '\n', in_len))) {
+			pfds[nfds].fd = STDIN_FILENO;
+			pfds[nfds].events = POLLIN;
+			owner[nfds++] = NULL;
+		}
+		for (i = 0; i < n; i++) {
+			copy *cp = &copies[i];
+			if (cp->chunk) {
+				pfds[nfds].fd = cp->in;
+				pfds[nfds].events = POLLOUT;
+				owner[nfds++] = cp;
+			}
+			if (cp->out != -1) {
+				pfds[nfds].fd = cp->out;
+				pfds[nfds].events = POLLIN;
+				owner[nfds++] = cp;
+			}
+			if (cp->pid && cp->in == -1 && cp->out == -1) {
+				/* Its pipes are done with: wait for the exit */
+				if (cp->pidfd == -1) {
+					reap_copy(cp);
+					continue;
+				}
+				pfds[nfds].fd = cp->pidfd;
+				pfds[nfds].events = POLLIN;
+				owner[nfds++] = cp;
+			}
+			busy |= cp->pid != 0;
+		}
+		/* Done when no copy is left running, and (ordered) no
+		 * chunk is left to start one for */
+		if (!busy && (!ordered || input_done || !nfds)) {
+			break;
+		}
+		if (poll(pfds, nfds, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < nfds; i++) {
+			copy *cp = owner[i];
+			if (!pfds[i].revents) {
+				continue;
+			}
+			if (!cp) {
+				read_input();
+			}
+			else if (pfds[i].fd == cp->in) {
+				feed(cp);
+			}
+			else if (pfds[i].fd == cp->pidfd) {
+				reap_copy(cp);
+			}
+			else {
+				char data[SHARD_BLOCK];
+				ssize_t got = read(cp->out, data, sizeof(data));
+				if (got == -1 && errno == EINTR) {
+					continue;
+				}
+				if (got <= 0) {
+					/* Unordered, a last line without a
+					 * newline goes out as it is */
+					if (!ordered) {
+						write_out(cp->buf, cp->buf_len);
+						cp->buf_len = 0;
+					}
+					close(cp->out);
+					cp->out = -1;
+				}
+				else if (ordered && cp->seq == emit_seq) {
+					write_out(data, got);
+				}
+				else {
+					buf_append(cp, data, got);
+				}
+				if (!ordered && cp->buf_len) {
+					/* Merge whole lines only */
+					char *nl = memrchr(cp->buf, '\n', cp->buf_len);
+					size_t whole = nl ? nl + 1 - cp->buf : 0;
+					write_out(cp->buf, whole);
+					memmove(cp->buf, cp->buf + whole,
+						cp->buf_len - whole);
+					cp->buf_len -= whole;
+				}
+			}
+		}
+		if (ordered) {
+			emit_ordered(&emit_seq);
+		}
+	}
+	exit(failed);
+}
@@ -0,0 +1,10 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "shell.h"
+
+/* Run a stage as N copies over stdin and stdout, exiting with the
+ * status of the first copy that failed; never returns */
+void run_shards(command *c, int n, int ordered);
+
+#endif
@@ -1,15 +1,42 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <mcheck.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <pthread.h>
 
 #include "parser.h"
 #include "shell.h"
+#include "record.h"
+#include "expand.h"
+#include "dirstack.h"
+#include "zdb.h"
+#include "watch.h"
+#include "cmdlog.h"
+#include "alias.h"
+#include "function.h"
+#include "options.h"
+#include "optimize.h"
+#include "explain.h"
+#include "dag.h"
+#include "tasks.h"
+#include "parallel.h"
+#include "profile.h"
+#include "pipeline.h"
+#include "plugin.h"
+#include "lookahead.h"
+#include "jobs.h"
 
 /**
  * Program that simulates a simple shell.
@@ -17,66 +44,359 @@
  * (cd and exit only), standard I/O redirection and piping (|). 
  */
 
-#define MAX_DIRNAME 100
 #define MAX_COMMAND 1024
 #define MAX_TOKEN 128
 
+pid_t shell_pid;                 /* The shell itself, not a child of it */
+int shell_interactive;           /* Reading commands from a terminal */
+static FILE *script_input;       /* Where the command lines come from */
+
+/* In a child: drop what the parent read ahead of the script */
+static void forget_script(void) {
+	__fpurge(script_input);
+}
+
 /* Functions to implement, see below after main */
 int execute_cd(char** words);
 int execute_nonbuiltin(simple_command *s);
-int execute_simple_command(simple_command *cmd);
-int execute_complex_command(command *cmd);
+int execute_group(command *c, int tail);
+int execute_subshell(command *c, int tail);
+int execute_simple_command(simple_command *cmd, int tail);
+int run_simple_command(simple_command *cmd, int tail);
+int execute_exec(simple_command *cmd);
+int run_string(const char *string);
+int exit_status(int status);
+void log_simple_command(simple_command *cmd, uint64_t start, int status,
+			struct rusage *ru);
 
 
 int main(int argc, char** argv) {
 	
-	char cwd[MAX_DIRNAME];           /* Current working directory */
-	char command_line[MAX_COMMAND];  /* The command */
-	char *tokens[MAX_TOKEN];         /* Command tokens (program name, 
-					  * parameters, pipe, etc.) */
+	char *command_string = NULL;     /* -c argument, if any */
+	char *replay = NULL;             /* Session file to replay, if any */
+	int instances = 1, paced = 0;    /* Replay options */
+	int profile = 0;                 /* --profile the script */
+
+	static struct option options[] = {
+		{ "record",    required_argument, NULL, 'r' },
+		{ "replay",    required_argument, NULL, 'R' },
+		{ "instances", required_argument, NULL, 'n' },
+		{ "paced",     no_argument,       NULL, 'p' },
+		{ "explain",   no_argument,       NULL, 'e' },
+		{ "profile",   no_argument,       NULL, 'P' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+	/* Stop at the first operand: the rest are the script's arguments */
+	while ((opt = getopt_long(argc, argv, "+c:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			command_string = optarg;
+			break;
+		case 'r':
+			if (record_open(optarg) == -1) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			replay = optarg;
+			break;
+		case 'n':
+			instances = atoi(optarg);
+			break;
+		case 'p':
+			paced = 1;
+			break;
+		case 'e':
+			shell_options[OPTION_EXPLAIN] = 1;
+			break;
+		case 'P':
+			profile = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [--record FILE] [--explain] "
+				"[-c command | script [args...]]\n"
+				"       %s --profile script [args...]\n"
+				"       %s --replay FILE [--instances N] [--paced]\n",
+				argv[0], argv[0], argv[0]);
+			return 1;
+		}
+	}
+
+	shell_pid = getpid();
+	if (replay) {
+		return replay_session(replay, instances, paced) == -1;
+	}
+
+	/* Non-interactive: nothing is initialized that the command
+	 * doesn't ask for; no prompt, no stdio on the input side */
+	if (command_string) {
+		set_positional(argv + optind);
+		run_string(command_string);
+		return last_status();
+	}
+
+	FILE *input = stdin;
+	if (optind < argc) {
+		input = fopen(argv[optind], "r");
+		if (!input) {
+			perror(argv[optind]);
+			return 127;
+		}
+		set_positional(argv + optind);
+	}
+	if (profile && (input == stdin || profile_start(argv[optind]) == -1)) {
+		fprintf(stderr, "%s: --profile needs a script\n", argv[0]);
+		return 1;
+	}
+	/* A child that exits without exec'ing would otherwise seek the
+	 * shared script offset back over the lines buffered ahead */
+	script_input = input;
+	pthread_atfork(NULL, NULL, forget_script);
+	shell_interactive = input == stdin && isatty(STDIN_FILENO);
+	/* Pipelines get the terminal; taking it back must not stop us */
+	if (shell_interactive)
+		signal(SIGTTOU, SIG_IGN);
+
+	/* A script file is read ahead while its commands run; stdin isn't,
+	 * the commands may be reading it themselves */
+	int lookahead = input != stdin && lookahead_start(input) == 0;
 
+	char *command_line = NULL;       /* The command */
+	size_t size = 0;
+	ssize_t len;
+	int lineno = 0;                  /* Of the line read last */
 	while (1) {
 
+		/* Report the background jobs that finished meanwhile */
+		notify_jobs();
+
 		/* Display prompt */		
-		getcwd(cwd, MAX_DIRNAME-1);
-		printf("%s> ", cwd);
+		if (shell_interactive) {
+			printf("%s> ", dir_pwd());
+			/* Flush now so forked children don't inherit the prompt */
+			fflush(stdout);
+		}
 		
-		/* Read the command line */
-		fgets(command_line, MAX_COMMAND, stdin);
+		/* Read the command line, stopping at end of input */
+		if (lookahead) {
+			free(command_line);
+			command_line = lookahead_next();
+			len = command_line ? (ssize_t)strlen(command_line) : -1;
+		}
+		else {
+			len = getline(&command_line, &size, input);
+		}
+		if (len == -1) {
+			break;
+		}
+		lineno++;
 		/* Strip the new line character */
-		if (command_line[strlen(command_line) - 1] == '\n') {
-			command_line[strlen(command_line) - 1] = '\0';
+		if (len > 0 && command_line[len - 1] == '\n') {
+			command_line[len - 1] = '\0';
 		}
-		
-		/* Parse the command into tokens */
-		parse_line(command_line, tokens);
 
-		/* Check for empty command */
-		if (!(*tokens)) {
-			continue;
-		}
+		/* Log the raw line before parsing rewrites it */
+		record_line(command_line);
 		
-		/* Construct chain of commands, if multiple commands */
-		command *cmd = construct_command(tokens);
-		//print_command(cmd, 0);
-    
-		int exitcode = 0;
-		if (cmd->scmd) {
-			exitcode = execute_simple_command(cmd->scmd);
-			if (exitcode == -1) {
-				break;
-			}
+		/* Script lines may run alongside each other */
+		profile_begin(lineno, command_line);
+		int exitcode = shell_options[OPTION_AUTOPARALLEL] &&
+			       !shell_interactive ? parallel_line(command_line) :
+			       run_line(command_line, 0);
+		profile_end();
+		if (exitcode == -1) {
+			break;
 		}
-		else {
-			exitcode = execute_complex_command(cmd);
-			if (exitcode == -1) {
-				break;
-			}
-		}
-		release_command(cmd);
 	}
+	parallel_drain();
+	profile_finish();
+	free(command_line);
+	record_close();
     
-	return 0;
+	return last_status();
+}
+
+
+/**
+ * Runs each line of a -c command string. The last line is in tail
+ * position: its last command replaces the shell instead of being waited
+ * for. Returns -1 if the shell should exit, 0 otherwise.
+ */
+int run_string(const char *string) {
+	char *copy = strdup(string), *line = copy, *next;
+	int exitcode = 0;
+	do {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		exitcode = run_line(line, !next);
+	} while (exitcode != -1 && (line = next));
+	free(copy);
+	return exitcode;
+}
+
+
+static int run_tokens(char **tokens, int max, int tail);
+
+/**
+ * Parses a command line into tokens, constructs the chain of commands
+ * and executes it. The line is modified in place by the parser.
+ * With tail, the last command may replace this process.
+ * Returns -1 if the shell should exit, 0 otherwise.
+ */
+int run_line(char *line, int tail) {
+
+	/* Every token takes at least one character of the line; short lines
+	 * keep MAX_TOKEN slots so aliases have room to expand */
+	int max = strlen(line) + 2;
+	if (max < MAX_TOKEN) {
+		max = MAX_TOKEN;
+	}
+	char **tokens = malloc(max * sizeof(char *)); /* Command tokens
+					  * (program name, parameters,
+					  * pipe, etc.) */
+	if (!tokens) {
+		perror("malloc");
+		return 0;
+	}
+
+	/* Parse the command into tokens */
+	parse_line(line, tokens);
+
+	static int depth;
+	depth++;
+	int exitcode = run_tokens(tokens, max, tail);
+	depth--;
+	free(tokens);
+	/* Aliases the line removed may have had its tokens */
+	if (!depth) {
+		alias_collect();
+	}
+	return exitcode;
+}
+
+/* Runs the tokens of a line; max is the capacity of the array */
+static int run_tokens(char **tokens, int max, int tail) {
+
+	/* Check for empty command */
+	if (!(*tokens)) {
+		return 0;
+	}
+	
+	/* Aliases are expanded as soon as the line is split into words */
+	expand_aliases(tokens, max);
+
+	/* Function definitions are parsed once and stored */
+	if (define_function(tokens)) {
+		return 0;
+	}
+
+	/* Keywords that take a whole command line as their argument */
+	if (!strcmp(tokens[0], "dag")) {
+		execute_dag(tokens);
+		return 0;
+	}
+	int status = -1;
+	if (!strcmp(tokens[0], "watch-run"))
+		status = execute_watch_run(tokens);
+	else if (!strcmp(tokens[0], "explain"))
+		status = execute_explain(tokens);
+	if (status != -1) {
+		set_status(status, &status, 1);
+		return 0;
+	}
+
+	/* Construct chain of commands, if multiple commands */
+	command *cmd = construct_command(tokens);
+	if (!cmd) {
+		return 0;
+	}
+	cmd = optimize_command(cmd);
+	if (shell_options[OPTION_EXPLAIN]) {
+		explain_plan(cmd, 0);
+	}
+
+	int exitcode = execute_plan(cmd, tail);
+	release_command(cmd);
+	return exitcode == -1 ? -1 : 0;
+}
+
+
+/* Set $? and PIPESTATUS after a lone stage, which may be all that is
+ * left of a pipeline the optimizer shortened; returns $? */
+static int set_plan_status(command *cmd, int status, int *statuses) {
+	int n = stage_statuses(cmd, status, statuses, 0);
+	/* A cat removed after it would have been the last stage */
+	if (cmd->elided_after && !shell_options[OPTION_PIPEFAIL])
+		status = 0;
+	set_status(status, statuses, n);
+	return status;
+}
+
+
+/**
+ * Executes a constructed chain of commands, returns its exit status.
+ * Returns -1 if the shell should exit.
+ *
+ * In tail position (nothing left for this process to do afterwards) the
+ * last simple command is exec'd in place rather than forked and waited
+ * for, and a subshell needs no fork of its own. The tail passes down to
+ * the right side of a list and into group and subshell bodies; pipelines
+ * still wait for all their stages.
+ */
+int execute_plan(command *cmd, int tail) {
+	int statuses[MAX_PIPESTATUS];
+	if (cmd->scmd) {
+		int status = execute_simple_command(cmd->scmd, tail);
+		if (status != -1)
+			status = set_plan_status(cmd, status, statuses);
+		return status;
+	}
+
+	if (!strcmp(cmd->oper, "&")) {
+		int status = start_job(cmd->cmd1);
+		set_status(status, &status, 1);
+		return status;
+	}
+
+	if (!strcmp(cmd->oper, "{") || !strcmp(cmd->oper, "(")) {
+		int status = cmd->oper[0] == '{' ? execute_group(cmd, tail) :
+			     execute_subshell(cmd, tail);
+		if (status != -1)
+			status = set_plan_status(cmd, status, statuses);
+		return status;
+	}
+
+	/* Lists: the right side runs always (;), only after success (&&)
+	 * or only after failure (||); $? is whatever ran last */
+	if (!strcmp(cmd->oper, ";") || !strcmp(cmd->oper, "&&") ||
+	    !strcmp(cmd->oper, "||")) {
+		int status = execute_plan(cmd->cmd1, 0);
+		if (status == -1)
+			return -1;
+		if ((cmd->oper[0] == '&' && status != 0) ||
+		    (cmd->oper[0] == '|' && status == 0))
+			return status;
+		return execute_plan(cmd->cmd2, tail);
+	}
+
+	/* Pipelines are logged as a whole; their stages are all children
+	 * of this call, so the rusage of reaped children covers them */
+	struct rusage before, after;
+	uint64_t start = cmdlog_now();
+	getrusage(RUSAGE_CHILDREN, &before);
+	int status = execute_pipeline(cmd);
+	getrusage(RUSAGE_CHILDREN, &after);
+
+	char text[MAX_COMMAND];
+	format_command(cmd, text, sizeof(text), 0);
+	timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+	timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+	cmdlog_record(text, start, status, &after);
+	return status;
 }
 
 
@@ -84,49 +404,34 @@ int main(int argc, char** argv) {
  * Changes directory to a path specified in the words argument;
  * For example: words[0] = "cd"
  *              words[1] = "csc209/assignment3/"
+ * Without a path, changes to $HOME; "cd -" returns to the previous
+ * directory. Relative paths are also looked up in $CDPATH.
  */
 int execute_cd(char** words) {
 	
-	/** 
-	 * The first word contains the "cd" string, the second one contains 
-	 * the path.
-	 * Check possible errors:
-	 * - The words pointer could be NULL, the first string or the second 
-	 *   string could be NULL, or the first string is not a cd command
-	 * - If so, return an EXIT_FAILURE status to indicate something is 
-	 *   wrong.
-	 */
+	/* Check if words or first word is NULL, also make sure first word is cd */
+	if (!words || !words[0] || strcmp(words[0], "cd"))
+		return EXIT_FAILURE;
 
-	 /* Check if words or first/second word is NULL, also make sure first word is cd */
-	 if (!words || !words[0] || !words[1] || strcmp(words[0], "cd"))
-	 	return EXIT_FAILURE;
+	const char *path = words[1];
+	if (!path)
+		path = getenv("HOME");
+	else if (!strcmp(path, "-"))
+		path = dir_oldpwd();
+	if (!path) {
+		errno = ENOENT;
+		return EXIT_FAILURE;
+	}
 
-	/**
-	 * First determine if the path is relative 
-	 * or absolute (see is_relative function provided).
-	 * - If it's not relative, then simply change the directory to the path 
-	 * specified in the second word in the array.
-	 * - If it's relative, then make sure to get the current working 
-	 * directory, append the path in the second word to the current working
-	 * directory and change the directory to this path.
-	 * Hints: see chdir and getcwd man pages.
-	 * Return the success/error code obtained when changing the directory.
-	 */
-	 if (!is_relative(words[1])) {
-	 	if (chdir(words[1]) == -1) /* Just change directory to the absolute path */
-	 		return EXIT_FAILURE;
-	 }
-	 else {
-	 	char dir[MAX_DIRNAME];
-	 	if (!getcwd(dir, MAX_DIRNAME-2)) /* Take the current directory */
-	 		return EXIT_FAILURE;
-	 	strncat(dir, "/", 1); 
-	 	/* Concatenate the relative path to get an absolute path */
-	 	strncat(dir, words[1], MAX_DIRNAME-strlen(dir)-1);
-	 	if (chdir(dir) == -1) /* Finally just change directories like usual */
-	 		return EXIT_FAILURE;
-	 }
-	 return EXIT_SUCCESS;
+	/* The directory layer resolves the path against the logical cwd
+	 * (and CDPATH) before entering it */
+	if (dir_change(path) == -1)
+		return EXIT_FAILURE;
+	zdb_visit(dir_pwd());
+
+	if (words[1] && !strcmp(words[1], "-"))
+		printf("%s\n", dir_pwd());
+	return EXIT_SUCCESS;
 }
 
 
@@ -161,110 +466,177 @@ int execute_command(char **tokens) {
 }
 
 
+/**
+ * exec [command]: replaces the shell with the command. Without one, the
+ * redirections apply to the shell itself from then on.
+ */
+int execute_exec(simple_command *cmd) {
+	fflush(stdout);
+	if (apply_redirections(cmd->in, cmd->out, cmd->err) == -1)
+		return EXIT_FAILURE;
+	if (!cmd->tokens[1])
+		return EXIT_SUCCESS;
+	execvp(cmd->tokens[1], cmd->tokens + 1);
+	int missing = errno == ENOENT;
+	perror(cmd->tokens[1]);
+	return missing ? 127 : 126;
+}
+
+
+/**
+ * Redirects stdin, stdout and stderr of this process to the given files
+ * (those that are not NULL). "&>" gives stdout and stderr the same file,
+ * which is opened once. Returns -1 (having printed why) on failure.
+ */
+int apply_redirections(const char *in, const char *out, const char *err) {
+	const char *files[3] = { in, out, err };
+	int fd;
+
+	for (fd = 0; fd < 3; fd++) {
+		if (!files[fd])
+			continue;
+		if (fd == STDERR_FILENO && err == out) {
+			if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
+				perror("dup2");
+				return -1;
+			}
+			continue;
+		}
+		/* Input is opened read only; output is truncated or created
+		 * with read/write permissions for owner and group, and read
+		 * permissions for everyone else */
+		int file = fd == STDIN_FILENO ? open(files[fd], O_RDONLY) :
+			   open(files[fd], O_CREAT | O_RDWR | O_TRUNC, 0664);
+		if (file == -1) {
+			perror(files[fd]);
+			return -1;
+		}
+		if (dup2(file, fd) == -1) {
+			perror("dup2");
+			close(file);
+			return -1;
+		}
+		close(file);
+	}
+	return 0;
+}
+
+
 /**
  * Executes a non-builtin command.
  */
 int execute_nonbuiltin(simple_command *s) {
 	/**
-	 * Check if the in, out, and err fields are set (not NULL),
-	 * and, IN EACH CASE:
-	 * - Open a new file descriptor (make sure you have the correct flags,
-	 *   and permissions);
-	 * - redirect stdin/stdout/stderr to the corresponding file.
-	 *   (hint: see dup2 man pages).
-	 * - close the newly opened file descriptor in the parent as well. 
-	 *   (Avoid leaving the file descriptor open across an exec!) 
-	 * - finally, execute the command using the tokens (see execute_command
-	 *   function above).
+	 * Redirect stdin/stdout/stderr to the files in the in, out and
+	 * err fields (when set), then execute the command using the
+	 * tokens (see execute_command function above). There is nothing
+	 * to do if a redirection fails, so print an error and exit.
 	 * This function returns only if the execution of the program fails.
 	 */
+	if (apply_redirections(s->in, s->out, s->err) == -1)
+		exit(1);
+	return execute_command(s->tokens); // This should never return.
+}
 
-	if (s->in) {
-		/* Open the file in read only mode, without changing permissions.
-		 * If we can't find the file or if reading from it fails, then
-		 * there is nothing to do, so print an error and exit.
-		 */
-	 	int in = open(s->in, O_RDONLY);
-	 	if (in == -1) {
-	 		perror(s->in);
-	 		exit(1);
-	 	}
-	 	/* Redirect stdin to read from the file we just opened.
-	 	 * If this fails, then there is not much we can do.
-	 	 * So print an error and exit.
-	 	 */
-		if (dup2(in, fileno(stdin)) == -1) {
-			perror("dup2");
-			exit(1);
-		}
-		/* Close the newly opened file descriptor, printing an error
-		 * and exiting on failure.
-		 */
-		if (close(in) == -1) {
-			perror("close");
-			exit(1);
+
+/* Keep copies of the descriptors the files will replace */
+static void save_fds(const char **files, int *saved) {
+	int fd;
+	/* Pending output belongs to the old descriptors */
+	fflush(stdout);
+	fflush(stderr);
+	for (fd = 0; fd < 3; fd++)
+		saved[fd] = files[fd] ? fcntl(fd, F_DUPFD_CLOEXEC, 10) : -1;
+}
+
+/* Put back the descriptors save_fds kept */
+static void restore_fds(int *saved) {
+	int fd;
+	fflush(stdout);
+	fflush(stderr);
+	for (fd = 0; fd < 3; fd++) {
+		if (saved[fd] != -1) {
+			dup2(saved[fd], fd);
+			close(saved[fd]);
 		}
 	}
-	if (s->out) {
-		/* Here we open the file descriptor in read/write mode, truncating
-		 * the contents of the file (if there are any) or creating a new
-		 * file if said file does not exist. We set the permissions to 0664.
-		 * That is, set read/write permissions for owner and group, but only
-		 * read permissions for everyone else. Print an error and exit on
-		 * failure.
-		 */
-		int out = open(s->out, O_CREAT | O_RDWR | O_TRUNC, 0664);
-		if (out == -1) {
-			perror(s->out);
-			exit(1);
-		}
-		/* As explained above, we redirect stout, printing an error and 
-		 * exiting on failure.
-		 */
-		if (dup2(out, fileno(stdout)) == -1) {
-			perror("dup2");
-			exit(1);
-		}
-		/* Close the newly opened file descriptor, printing an error
-		 * and exiting on failure.
-		 */
-		if (close(out) == -1) {
-			perror("close");
-			exit(1);
-		}
+}
+
+
+/**
+ * Runs a "{ ... }" group in this process, its redirections applied once
+ * around the whole body and undone afterwards. In tail position there is
+ * nothing to undo them for.
+ */
+int execute_group(command *c, int tail) {
+	expansion e;
+	int saved[3], status = EXIT_FAILURE;
+	memset(&e, 0, sizeof(e));
+	const char *files[3] = { expand_word(c->in, &e), expand_word(c->out, &e),
+				 expand_word(c->err, &e) };
+
+	if (tail) {
+		if (apply_redirections(files[0], files[1], files[2]) == 0)
+			status = execute_plan(c->cmd1, 1);
+		release_expansion(&e);
+		return status;
 	}
-	if (s->err) {
-		/* Open the file descriptor as in the case for redirecting stdout.
-		 * Print an error and exit on failure.
-		 */
-		int err = open(s->in, O_CREAT | O_RDWR | O_TRUNC, 0664);
-		if (err == -1) {
-			perror(s->err);
-			exit(1);
-		}
-		/* Redirect stderr, printing an error and exiting
-		 * on failure.
-		 */
-		if (dup2(err, fileno(stderr)) == -1) {
-			perror("dup2");
-			exit(1);
-		}
-		/* Close the newly opened file descriptor, printing an error
-		 * and exiting on failure.
-		 */
-		if (close(err) == -1) {
-			perror("close");
-			exit(1);
-		}
+
+	save_fds(files, saved);
+	if (apply_redirections(files[0], files[1], files[2]) == 0)
+		status = execute_plan(c->cmd1, 0);
+	restore_fds(saved);
+	release_expansion(&e);
+	return status;
+}
+
+
+/**
+ * Runs a "( ... )" subshell: one fork, and the child runs the body
+ * itself rather than exec'ing another shell. In tail position this
+ * process is as good as the child, so there is no fork at all.
+ */
+int execute_subshell(command *c, int tail) {
+	if (tail)
+		return execute_group(c, 1);
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return EXIT_FAILURE;
 	}
-	return execute_command(s->tokens); // This should never return.
+	if (pid == 0)
+		execute_complex_command(c);
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		return EXIT_FAILURE;
+	}
+	return exit_status(status);
+}
+
+
+/**
+ * Expands the command substitutions of a simple command into a temporary
+ * copy, leaving the constructed command untouched.
+ */
+void expand_simple_command(simple_command *s, simple_command *x,
+			   expansion *e) {
+	*x = *s;
+	expand_words(s->tokens, e);
+	x->tokens = e->argv;
+	x->in = expand_word(s->in, e);
+	x->out = expand_word(s->out, e);
+	x->err = expand_word(s->err, e);
 }
 
 
 /**
  * Executes a simple command (no pipes).
  */
-int execute_simple_command(simple_command *cmd) {
+int execute_simple_command(simple_command *cmd, int tail) {
 
 	/**
 	 * Check if the command is builtin.
@@ -276,199 +648,173 @@ int execute_simple_command(simple_command *cmd) {
 	 * - The parent should wait for the child.
 	 *   (see wait man pages).
 	 */
-	if (cmd->builtin == BUILTIN_EXIT)
-		return -1;
+	simple_command expanded;
+	expansion e;
+	expand_simple_command(cmd, &expanded, &e);
+	int status = run_simple_command(&expanded, tail);
+	release_expansion(&e);
+	return status;
+}
+
+
+/**
+ * Executes an expanded simple command; in tail position a program
+ * replaces this process.
+ */
+int run_simple_command(simple_command *cmd, int tail) {
+
+	/* The substitutions may have expanded to nothing */
+	if (!cmd->tokens[0])
+		return 0;
+
+	/* Functions run in this process, no fork needed; like a group,
+	 * the call's redirections are undone when it returns */
+	command *body = lookup_function(cmd->tokens[0]);
+	if (body) {
+		const char *files[3] = { cmd->in, cmd->out, cmd->err };
+		int saved[3], status = EXIT_FAILURE;
+		if (!cmd->in && !cmd->out && !cmd->err)
+			return call_function(body, cmd->tokens);
+		save_fds(files, saved);
+		if (apply_redirections(cmd->in, cmd->out, cmd->err) == 0)
+			status = call_function(body, cmd->tokens);
+		restore_fds(saved);
+		return status;
+	}
+
+	if (cmd->builtin == BUILTIN_EXIT) {
 		/* I choose to return -1 here instead of doing exit(0) as
 		 * it produces the same results. It also makes more sense
 		 * to exit through main, since we are searching for special
 		 * values (namely -1) in our main loop. Checking for these
 		 * values would be pointless if they are never returned
 		 * from execute_simple_command or execute_complex_command.
+		 * exit N leaves N in $? for main to return.
 		 */
+		int status = cmd->tokens[1] ? atoi(cmd->tokens[1]) & 0xff :
+			     last_status();
+		set_status(status, &status, 1);
+		return -1;
+	}
 	else if (cmd->builtin == BUILTIN_CD) {
 		/* Change directories and check for errors.
 		 * If an error occurred, this means the given
 		 * path was invalid, so print an error and continue
-		 * the main loop by returning 0.
+		 * the main loop with a failure status.
 		 */
 		if (execute_cd(cmd->tokens) == EXIT_FAILURE) {
-			if (!cmd->tokens[1])
-				fprintf(stderr, "Path expected after cd\n");
-			else
-				perror(cmd->tokens[1]);
+			perror(cmd->tokens[1] ? cmd->tokens[1] : "cd");
+			return EXIT_FAILURE;
 		}
-		return 0;
+		return EXIT_SUCCESS;
+	}
+	else if (cmd->builtin == BUILTIN_PUSHD) {
+		return execute_pushd(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_POPD) {
+		return execute_popd(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_DIRS) {
+		return execute_dirs(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_JUMP) {
+		return execute_jump(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_CMDLOG) {
+		return execute_cmdlog(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_ALIAS) {
+		return execute_alias(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_UNALIAS) {
+		return execute_unalias(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_SET) {
+		return execute_set(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_EXEC) {
+		return execute_exec(cmd);
+	}
+	else if (cmd->builtin == BUILTIN_ENABLE) {
+		return execute_enable(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_LOADABLE) {
+		return run_loadable(cmd);
+	}
+	else if (cmd->builtin == BUILTIN_JOBS) {
+		return execute_jobs(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_WAIT) {
+		return execute_wait(cmd->tokens);
+	}
+	else if (cmd->builtin == BUILTIN_TASKS) {
+		return execute_tasks(cmd->tokens);
+	}
+
+	/* Nothing would be left to wait for the child: become it */
+	if (tail) {
+		fflush(stdout);
+		execute_nonbuiltin(cmd);
 	}
 
 	/* If the command is not builtin, then start a new process
 	 * and call execute_nonbuiltin within this new process.
 	 * If an error occurs, return to the main loop.
 	 */
+	/* Builtin output must not be duplicated or reordered by the child */
+	fflush(stdout);
+	uint64_t start = cmdlog_now();
 	int pid = fork();
 
-	if (pid == -1)
+	if (pid == -1) {
 		perror("fork");
+		return EXIT_FAILURE;
+	}
 	else if (pid == 0)
 		execute_nonbuiltin(cmd);
-	else {
-		int status;
-		/* If wait fails, continue the main loop */
-		if (wait(&status) == -1)
-			perror("wait");
+
+	int status;
+	struct rusage ru;
+	/* If wait fails, continue the main loop */
+	if (wait4(pid, &status, 0, &ru) == -1) {
+		perror("wait");
+		return EXIT_FAILURE;
 	}
-	return 0;
+	log_simple_command(cmd, start, exit_status(status), &ru);
+	return exit_status(status);
 }
 
 
 /**
- * Executes a complex command.  A complex command is two commands chained 
- * together with a pipe operator.
+ * Converts a wait status to a shell exit status (128+N for signal N).
  */
-int execute_complex_command(command *c) {
+int exit_status(int status) {
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
 
-	/**
-	 * Check if this is a simple command, using the scmd field.
-	 * Remember that this will be called recursively, so when you encounter
-	 * a simple command you should act accordingly.
-	 * Execute nonbuiltin commands only. If it's exit or cd, you should not 
-	 * execute these in a piped context, so simply ignore builtin commands. 
-	 */
-	if (c->scmd)
-		execute_nonbuiltin(c->scmd);
 
-	/** 
-	 * Optional: if you wish to handle more than just the 
-	 * pipe operator '|' (the '&&', ';' etc. operators), then 
-	 * you can add more options here. 
-	 */
-	if (!strcmp(c->oper, "|")) {
-		/**
-		 * TODO: Create a pipe "pfd" that generates a pair of file 
-		 * descriptors, to be used for communication between the 
-		 * parent and the child. Make sure to check any errors in 
-		 * creating the pipe.
-		 */
-		int pfd[2];
-		if (pipe(pfd) == -1) {
-			perror("pipe");
-			exit(1); // There is little we can do if pipe fails.
-					 // So just exit.
-		}
+/**
+ * Records an executed simple command in the command log.
+ */
+void log_simple_command(simple_command *cmd, uint64_t start, int status,
+			struct rusage *ru) {
+	command c = { NULL, NULL, cmd, "", NULL, NULL, NULL, 0, 0 };
+	char text[MAX_COMMAND];
+	format_command(&c, text, sizeof(text), 0);
+	cmdlog_record(text, start, status, ru);
+}
 
-		/**
-		 * In the child:
-		 *  - close one end of the pipe pfd and close the stdout 
-		 * file descriptor.
-		 *  - connect the stdout to the other end of the pipe (the 
-		 * one you didn't close).
-		 *  - execute complex command cmd1 recursively. 
-		 * In the parent: 
-		 *  - fork a new process to execute cmd2 recursively.
-		 *  - In child 2:
-		 *     - close one end of the pipe pfd (the other one than 
-		 *       the first child), and close the standard input file 
-		 *       descriptor.
-		 *     - connect the stdin to the other end of the pipe (the 
-		 *       one you didn't close).
-		 *     - execute complex command cmd2 recursively. 
-		 *  - In the parent:
-		 *     - close both ends of the pipe. 
-		 *     - wait for both children to finish.
-		 */
-		int pid1 = fork();
 
-		if (pid1 == -1) {
-			perror("fork");
-			exit(1);
-		}
-		else if (pid1 == 0) {
-			/* Close the reading end of the pipe,
-			 * printing an error and exiting on failure.
-			 */
-			if (close(pfd[0]) == -1) {
-				perror("close");
-				exit(1);
-			}
-			/* Redirect stdout to the writing end of the pipe, 
-			 * printing an error and exiting on failure.
-			 */
-			if (dup2(pfd[1], fileno(stdout)) == -1) {
-				perror("dup2");
-				exit(1);
-			}
-			/* Close the other end of the pipe,
-			 * printing an error and exiting on failure.
-			 */
-			if (close(pfd[1]) == -1) {
-				perror("close");
-				exit(1);
-			}
-			execute_complex_command(c->cmd1);
-			exit(0); // We must destroy the child process
-					 // after it executes the command, since
-					 // this was its only purpose.
-		}
-		else {
-			int pid2 = fork();
-
-			if (pid2 == -1) {
-				perror("fork");
-				exit(1);
-			}
-			else if (pid2 == 0) {
-				/* Close the writing end of the pipe, 
-				 * printing an error and exiting on failure.
-				 */
-				if (close(pfd[1]) == -1) {
-					perror("close");
-					exit(1);
-				}
-				/* Redirect stdin to the reading end of the pipe,
-				 * printing an error and exiting on failure.
-				 */
-				if (dup2(pfd[0], fileno(stdin)) == -1) {
-					perror("dup2");
-					exit(1);
-				}
-				/* Close the other end of the pipe,
-				 * printing an error and exiting on failure.
-				 */
-				if (close(pfd[0]) == -1) {
-					perror("close");
-					exit(1);
-				}
-				execute_complex_command(c->cmd2);
-				exit(0); // Again, destroy the child process.
-			}
-			else {
-				/* Close both ends of the pipe, printing
-				 * an error and exiting on failure.
-				 */
-				if (close(pfd[0]) == -1) {
-					perror("close");
-					exit(1);
-				}
-				if (close(pfd[1]) == -1) {
-					perror("close");
-					exit(1);
-				}
-				int status1, status2;
-				/* Wait for both of the child processes. It is not 
-				 * necessary to know if the children exited abnormally, 
-				 * or what their exit statuses were. So there is no
-				 * need to do anything with status1 and status2. We
-				 * just need to know that the children exited.
-				 */
-				if (waitpid(pid1, &status1, 0) == -1) {
-					perror("waitpid");
-					exit(1);
-				}
-				if (waitpid(pid2, &status2, 0) == -1) {
-					perror("waitpid");
-					exit(1);
-				}
-			}
-		}
-	}
-	return 0;
+/**
+ * Executes a command inside a child process, which exits with its status.
+ * Everything runs in tail position: a program replaces the child rather
+ * than being forked from it, and a subshell runs in it directly.
+ * Builtins run in the child too, so they only affect the child.
+ * Never returns.
+ */
+int execute_complex_command(command *c) {
+	int status = execute_plan(c, 1);
+	exit(status == -1 ? last_status() : status);
 }
@@ -4,6 +4,20 @@
 /* built-in commands */
 #define BUILTIN_CD   1
 #define BUILTIN_EXIT 2
+#define BUILTIN_PUSHD 3
+#define BUILTIN_POPD 4
+#define BUILTIN_DIRS 5
+#define BUILTIN_JUMP 6
+#define BUILTIN_CMDLOG 7
+#define BUILTIN_ALIAS 8
+#define BUILTIN_UNALIAS 9
+#define BUILTIN_SET 10
+#define BUILTIN_EXEC 11
+#define BUILTIN_ENABLE 12
+#define BUILTIN_LOADABLE 13      /* Enabled from a shared library */
+#define BUILTIN_JOBS 14
+#define BUILTIN_WAIT 15
+#define BUILTIN_TASKS 16
 
 typedef struct simple_command_t {
 	char *in, *out, *err;    /* Files for redirection, optional */
@@ -17,9 +31,36 @@ typedef struct command_t {
 	struct command_t *cmd1, *cmd2;  
 
 	simple_command* scmd; /* Simple command, no pipe */
-	char oper[2];   /* In this assignment, consider only "|".
-	                Optional: implement other operators: ";", "&&", etc. */
+	char oper[8];   /* "|", "|!" for a metered pipe, "|N|" or "|Nu|" for
+	                 * a sharded one; ";", "&&", "||";
+	                 * "{" for a group, "(" for a subshell, "&" for a
+	                 * background job (cmd1 only) */
+	char *in, *out, *err;   /* Redirections of a group or subshell */
+	int elided_before, elided_after; /* cat stages the optimizer removed
+	                 * around this stage; PIPESTATUS keeps a 0 for each */
 } command;
 
+#include <sys/types.h>
+
+extern pid_t shell_pid;          /* The shell itself, not a child of it */
+extern int shell_interactive;    /* Reading commands from a terminal */
+
+/* Parse and execute one command line (modified in place). With tail,
+ * nothing runs in this process afterwards, so its last command may
+ * replace the process. Returns -1 if the shell should exit, 0 otherwise. */
+int run_line(char *line, int tail);
+
+/* Execute a constructed chain of commands, tail as for run_line.
+ * Returns its exit status, or -1 if the shell should exit. */
+int execute_plan(command *cmd, int tail);
+
+/* Point stdin, stdout and stderr at the files given (where not NULL);
+ * returns -1, having said why, on failure */
+int apply_redirections(const char *in, const char *out, const char *err);
+
+/* Execute a command inside a child process, exiting with its status;
+ * never returns */
+int execute_complex_command(command *cmd);
+
 #endif
 
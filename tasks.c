@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tasks.h"
+#include "parser.h"
+#include "shell.h"
+#include "expand.h"
+
+/**
+ * tasks: a make-like runner for rule files.
+ *
+ *   # Tasksfile
+ *   report.txt: sales.csv totals.awk
+ *   	awk -f totals.awk sales.csv > report.txt
+ *
+ * A rule is "targets: dependencies" followed by its command lines, which
+ * are indented. The lines are constructed once, up front, and each rule
+ * runs in a child of its own, one line after another, stopping at the
+ * first that fails. "tasks [target...]" brings the targets (by default
+ * the first rule's) up to date, running up to -j N rules at once as their
+ * dependencies finish; children are waited for through pidfds.
+ *
+ * A rule is stale if one of its targets is missing, its commands have
+ * changed, or it failed last time. By default it is also stale if a
+ * dependency is newer than its oldest target, or was rebuilt just now.
+ * With -H it is instead stale when the contents of its dependencies
+ * hash differently from its last successful run, so a dependency that
+ * was rebuilt into the same bytes rebuilds nothing after it.
+ *
+ * Every rule that runs is recorded in FILE.db, one line per target:
+ * target, status, end time, duration in ms, hash of the commands and
+ * hash of the inputs. After the first failure no new rules are started
+ * and the ones running are waited for. -n prints the commands instead of
+ * running them.
+ */
+
+#define TASKS_FILE "Tasksfile"
+#define HASH_BUF (64 * 1024)
+#define FNV_BASIS 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+enum { WAITING, RUNNING, UP_TO_DATE, BUILT, FAILED };
+
+/* A command line of a rule, constructed once */
+typedef struct task_line {
+	char *text;              /* What the tokens point into */
+	char **tokens;
+	command *plan;
+} task_line;
+
+typedef struct task {
+	char **targets, **deps;
+	int ntargets, ndeps;
+	int *dep_task;           /* The rule making each dependency, or -1 */
+	task_line *lines;
+	int nlines;
+	uint64_t rule_hash;      /* Of the command text */
+	uint64_t inputs;         /* Hash of the dependencies' contents (-H) */
+	int needed, visit;
+	int state, status;
+	pid_t pid;
+	int pidfd;
+	struct timespec start;
+} task;
+
+/* What the state database says about a target */
+typedef struct task_record {
+	char *target;
+	int status;
+	long end, ms;
+	uint64_t rule_hash, inputs;
+} task_record;
+
+static task *tasks;
+static int ntasks;
+static task_record *records;
+static int nrecords;
+
+static uint64_t fnv(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	while (len--) {
+		h = (h ^ *p++) * FNV_PRIME;
+	}
+	return h;
+}
+
+static int find_task(const char *target) {
+	int i, j;
+	for (i = 0; i < ntasks; i++) {
+		for (j = 0; j < tasks[i].ntargets; j++) {
+			if (!strcmp(tasks[i].targets[j], target)) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+static task_record *find_record(const char *target) {
+	int i;
+	for (i = 0; i < nrecords; i++) {
+		if (!strcmp(records[i].target, target)) {
+			return &records[i];
+		}
+	}
+	return NULL;
+}
+
+/* Split text into words at whitespace, appending to *words */
+static void add_words(char *text, char ***words, int *n) {
+	char *save, *w;
+	for (w = strtok_r(text, " \t", &save); w;
+	     w = strtok_r(NULL, " \t", &save)) {
+		*words = realloc(*words, (*n + 1) * sizeof(char *));
+		(*words)[(*n)++] = strdup(w);
+	}
+}
+
+/* Construct a command line into the last rule */
+static int add_line(task *t, const char *text) {
+	task_line *l;
+	t->lines = realloc(t->lines, (t->nlines + 1) * sizeof(task_line));
+	l = &t->lines[t->nlines];
+	t->rule_hash = fnv(t->rule_hash, text, strlen(text) + 1);
+	l->text = strdup(text);
+	l->tokens = malloc((strlen(text) + 2) * sizeof(char *));
+	parse_line(l->text, l->tokens);
+	int empty = !l->tokens[0];
+	l->plan = empty ? NULL : construct_command(l->tokens);
+	if (!l->plan) {
+		free(l->tokens);
+		free(l->text);
+		return empty ? 0 : -1;
+	}
+	t->nlines++;
+	return 0;
+}
+
+/* Read the rules; returns -1, having said why, if they can't be used */
+static int read_rules(const char *file) {
+	FILE *f = fopen(file, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int n = 0, i;
+
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	while ((len = getline(&line, &cap, f)) != -1) {
+		n++;
+		while (len > 0 && isspace((unsigned char)line[len - 1])) {
+			line[--len] = '\0';
+		}
+		char *text = line + strspn(line, " \t");
+		if (!*text || *text == '#') {
+			continue;
+		}
+		if (text != line) {
+			/* An indented command line */
+			if (!ntasks) {
+				fprintf(stderr, "%s:%d: command outside a rule\n",
+					file, n);
+				break;
+			}
+			if (add_line(&tasks[ntasks - 1], text) == -1) {
+				fprintf(stderr, "%s:%d: bad command\n", file, n);
+				break;
+			}
+			continue;
+		}
+
+		char *colon = strchr(line, ':');
+		if (!colon) {
+			fprintf(stderr, "%s:%d: expected 'targets: dependencies'\n",
+				file, n);
+			break;
+		}
+		*colon = '\0';
+		tasks = realloc(tasks, (ntasks + 1) * sizeof(task));
+		task *t = &tasks[ntasks];
+		memset(t, 0, sizeof(task));
+		t->rule_hash = FNV_BASIS;
+		t->pidfd = -1;
+		add_words(line, &t->targets, &t->ntargets);
+		add_words(colon + 1, &t->deps, &t->ndeps);
+		if (!t->ntargets) {
+			fprintf(stderr, "%s:%d: rule without a target\n", file, n);
+			break;
+		}
+		for (i = 0; i < t->ntargets; i++) {
+			if (find_task(t->targets[i]) != -1) {
+				fprintf(stderr, "%s:%d: second rule for '%s'\n",
+					file, n, t->targets[i]);
+				break;
+			}
+		}
+		ntasks++;
+		if (i < t->ntargets) {
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return len == -1 ? 0 : -1;
+}
+
+/* Mark what a target needs, refusing cycles and missing files */
+static int need(const char *target, const char *by) {
+	int t = find_task(target), i;
+	struct stat sb;
+
+	if (t == -1) {
+		if (stat(target, &sb) == 0) {
+			return 0;
+		}
+		if (by) {
+			fprintf(stderr, "tasks: no rule to make '%s', needed by "
+				"'%s'\n", target, by);
+		}
+		else {
+			fprintf(stderr, "tasks: no rule to make '%s'\n", target);
+		}
+		return -1;
+	}
+	if (tasks[t].visit == 1) {
+		fprintf(stderr, "tasks: cycle through '%s'\n", target);
+		return -1;
+	}
+	if (tasks[t].visit == 2) {
+		return 0;
+	}
+	tasks[t].visit = 1;
+	tasks[t].needed = 1;
+	tasks[t].dep_task = malloc((tasks[t].ndeps + 1) * sizeof(int));
+	for (i = 0; i < tasks[t].ndeps; i++) {
+		tasks[t].dep_task[i] = find_task(tasks[t].deps[i]);
+		if (need(tasks[t].deps[i], target) == -1) {
+			return -1;
+		}
+	}
+	tasks[t].visit = 2;
+	return 0;
+}
+
+/* A file's contents, or for anything else its name and mtime */
+static uint64_t hash_file(const char *path, uint64_t h) {
+	struct stat sb;
+	h = fnv(h, path, strlen(path) + 1);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		if (fd != -1) {
+			h = fnv(h, &sb.st_mtim, sizeof(sb.st_mtim));
+			close(fd);
+		}
+		return h;
+	}
+	char *buf = malloc(HASH_BUF);
+	ssize_t n;
+	while ((n = read(fd, buf, HASH_BUF)) > 0) {
+		h = fnv(h, buf, n);
+	}
+	free(buf);
+	close(fd);
+	return h;
+}
+
+static int newer(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec > b->tv_sec ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/* Whether a rule whose dependencies are all done has to run */
+static int stale(task *t, int by_hash) {
+	task_record *r = find_record(t->targets[0]);
+	struct timespec oldest = { 0, 0 };
+	struct stat sb;
+	int i;
+
+	/* Hashed up front: the record keeps it even if the rule runs for
+	 * another reason */
+	if (by_hash) {
+		t->inputs = FNV_BASIS;
+		for (i = 0; i < t->ndeps; i++) {
+			t->inputs = hash_file(t->deps[i], t->inputs);
+		}
+	}
+	for (i = 0; i < t->ntargets; i++) {
+		if (stat(t->targets[i], &sb) == -1) {
+			return 1;
+		}
+		if (i == 0 || newer(&oldest, &sb.st_mtim)) {
+			oldest = sb.st_mtim;
+		}
+	}
+	if (r && (r->status || r->rule_hash != t->rule_hash)) {
+		return 1;
+	}
+
+	if (by_hash) {
+		return !r || r->inputs != t->inputs;
+	}
+	for (i = 0; i < t->ndeps; i++) {
+		if (t->dep_task[i] != -1 && tasks[t->dep_task[i]].state == BUILT) {
+			return 1;
+		}
+		if (stat(t->deps[i], &sb) == -1 || newer(&sb.st_mtim, &oldest)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Print a rule's command lines, as -n does and as they run */
+static void show_lines(task *t) {
+	char text[1024];
+	int i;
+	for (i = 0; i < t->nlines; i++) {
+		text[0] = '\0';
+		format_command(t->lines[i].plan, text, sizeof(text), 0);
+		printf("%s\n", text);
+	}
+	fflush(stdout);
+}
+
+static void start_task(task *t) {
+	show_lines(t);
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->pid = fork();
+	if (t->pid == 0) {
+		int i, status = EXIT_SUCCESS;
+		for (i = 0; i < t->nlines && status == EXIT_SUCCESS; i++) {
+			status = execute_plan(t->lines[i].plan, i == t->nlines - 1);
+			if (status == -1) {
+				status = last_status();
+				break;
+			}
+		}
+		exit(status);
+	}
+	if (t->pid == -1) {
+		perror("fork");
+		t->state = FAILED;
+		t->status = EXIT_FAILURE;
+		return;
+	}
+	t->state = RUNNING;
+	t->pidfd = syscall(SYS_pidfd_open, t->pid, 0);
+}
+
+/* Record how a rule's run went, for every one of its targets */
+static void record_task(task *t) {
+	struct timespec end;
+	int i;
+	/* Timed on the monotonic clock, stamped with the wall clock */
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	time_t now = time(NULL);
+	for (i = 0; i < t->ntargets; i++) {
+		task_record *r = find_record(t->targets[i]);
+		if (!r) {
+			records = realloc(records, (nrecords + 1) * sizeof(task_record));
+			r = &records[nrecords++];
+			r->target = strdup(t->targets[i]);
+		}
+		r->status = t->status;
+		r->end = now;
+		r->ms = (end.tv_sec - t->start.tv_sec) * 1000 +
+			(end.tv_nsec - t->start.tv_nsec) / 1000000;
+		r->rule_hash = t->rule_hash;
+		r->inputs = t->inputs;
+	}
+}
+
+/* Reap a running rule if it exited (or, blocking, when it does) */
+static int reap_task(task *t, int block) {
+	int ws;
+	if (waitpid(t->pid, &ws, block ? 0 : WNOHANG) != t->pid) {
+		return 0;
+	}
+	if (t->pidfd != -1) {
+		close(t->pidfd);
+		t->pidfd = -1;
+	}
+	t->status = WIFSIGNALED(ws) ? 128 + WTERMSIG(ws) : WEXITSTATUS(ws);
+	t->state = t->status ? FAILED : BUILT;
+	record_task(t);
+	if (t->status) {
+		fprintf(stderr, "tasks: '%s' failed (status %d)\n",
+			t->targets[0], t->status);
+	}
+	return 1;
+}
+
+/* Start what is ready, up to jobs at once, until everything needed is
+ * done or a rule failed; returns the first failure's status */
+static int run_tasks(int jobs, int by_hash, int dry_run) {
+	struct pollfd *pfds = calloc(ntasks, sizeof(struct pollfd));
+	int running = 0, failed = 0, i, j;
+
+	for (;;) {
+		int progress = 1;
+		while (progress && !failed) {
+			progress = 0;
+			for (i = 0; i < ntasks; i++) {
+				task *t = &tasks[i];
+				if (!t->needed || t->state != WAITING) {
+					continue;
+				}
+				for (j = 0; j < t->ndeps; j++) {
+					int d = t->dep_task[j];
+					if (d != -1 && tasks[d].state != UP_TO_DATE &&
+					    tasks[d].state != BUILT) {
+						break;
+					}
+				}
+				if (j < t->ndeps) {
+					continue;
+				}
+				if (!stale(t, by_hash)) {
+					t->state = UP_TO_DATE;
+					progress = 1;
+				}
+				else if (dry_run) {
+					show_lines(t);
+					t->state = BUILT;
+					progress = 1;
+				}
+				else if (running < jobs) {
+					start_task(t);
+					if (t->state == FAILED) {
+						failed = t->status;
+						break;
+					}
+					running++;
+					progress = 1;
+				}
+			}
+		}
+		if (!running) {
+			break;
+		}
+
+		int n = 0;
+		for (i = 0; i < ntasks; i++) {
+			if (tasks[i].state == RUNNING && tasks[i].pidfd != -1) {
+				pfds[n].fd = tasks[i].pidfd;
+				pfds[n++].events = POLLIN;
+			}
+		}
+		if (n && poll(pfds, n, -1) == -1 && errno != EINTR) {
+			perror("poll");
+		}
+		for (i = 0; i < ntasks; i++) {
+			task *t = &tasks[i];
+			/* Without a pidfd, wait for it outright */
+			if (t->state == RUNNING && reap_task(t, !n && t->pidfd == -1)) {
+				running--;
+				if (t->status && !failed) {
+					failed = t->status;
+				}
+			}
+		}
+	}
+	free(pfds);
+	return failed;
+}
+
+static void load_records(const char *db) {
+	FILE *f = fopen(db, "r");
+	char target[4096];
+	task_record r;
+	unsigned long long rule_hash, inputs;
+	if (!f) {
+		return;
+	}
+	while (fscanf(f, "%4095s %d %ld %ld %llx %llx", target, &r.status,
+		      &r.end, &r.ms, &rule_hash, &inputs) == 6) {
+		records = realloc(records, (nrecords + 1) * sizeof(task_record));
+		r.target = strdup(target);
+		r.rule_hash = rule_hash;
+		r.inputs = inputs;
+		records[nrecords++] = r;
+	}
+	fclose(f);
+}
+
+/* Write the database next to its old self, then move it over */
+static void save_records(const char *db) {
+	char tmp[4096];
+	int i;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", db,
+		     (int)getpid()) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "tasks: %s: name too long\n", db);
+		return;
+	}
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+	for (i = 0; i < nrecords; i++) {
+		fprintf(f, "%s\t%d\t%ld\t%ld\t%016llx\t%016llx\n", records[i].target,
+			records[i].status, records[i].end, records[i].ms,
+			(unsigned long long)records[i].rule_hash,
+			(unsigned long long)records[i].inputs);
+	}
+	if (fclose(f) == EOF || rename(tmp, db) == -1) {
+		perror(db);
+		unlink(tmp);
+	}
+}
+
+static void release_tasks(void) {
+	int i, j;
+	for (i = 0; i < ntasks; i++) {
+		task *t = &tasks[i];
+		for (j = 0; j < t->ntargets; j++) {
+			free(t->targets[j]);
+		}
+		for (j = 0; j < t->ndeps; j++) {
+			free(t->deps[j]);
+		}
+		for (j = 0; j < t->nlines; j++) {
+			release_command(t->lines[j].plan);
+			free(t->lines[j].tokens);
+			free(t->lines[j].text);
+		}
+		free(t->targets);
+		free(t->deps);
+		free(t->dep_task);
+		free(t->lines);
+	}
+	for (i = 0; i < nrecords; i++) {
+		free(records[i].target);
+	}
+	free(tasks);
+	free(records);
+	tasks = NULL;
+	records = NULL;
+	ntasks = nrecords = 0;
+}
+
+/* Builtin: tasks [-f file] [-j N] [-H] [-n] [target...] */
+int execute_tasks(char **words) {
+	const char *file = TASKS_FILE;
+	int jobs = 1, by_hash = 0, dry_run = 0, i, status = EXIT_FAILURE;
+
+	for (i = 1; words[i] && words[i][0] == '-'; i++) {
+		if (!strcmp(words[i], "-f") && words[i + 1]) {
+			file = words[++i];
+		}
+		else if (!strcmp(words[i], "-j") && words[i + 1] &&
+			 atoi(words[i + 1]) > 0) {
+			jobs = atoi(words[++i]);
+		}
+		else if (!strcmp(words[i], "-H")) {
+			by_hash = 1;
+		}
+		else if (!strcmp(words[i], "-n")) {
+			dry_run = 1;
+		}
+		else {
+			fprintf(stderr, "usage: tasks [-f file] [-j N] [-H] [-n] "
+				"[target...]\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	char db[4096];
+	snprintf(db, sizeof(db), "%s.db", file);
+	if (read_rules(file) == -1) {
+		release_tasks();
+		return EXIT_FAILURE;
+	}
+	if (!ntasks) {
+		fprintf(stderr, "tasks: no rules in %s\n", file);
+		release_tasks();
+		return EXIT_FAILURE;
+	}
+	int ok = words[i] ? 1 : need(tasks[0].targets[0], NULL) == 0;
+	for (; ok && words[i]; i++) {
+		ok = need(words[i], NULL) == 0;
+	}
+	if (ok) {
+		load_records(db);
+		status = run_tasks(jobs, by_hash, dry_run);
+		if (!dry_run) {
+			save_records(db);
+		}
+	}
+	release_tasks();
+	return status;
+}
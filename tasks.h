@@ -0,0 +1,9 @@
+#ifndef __TASKS_H__
+#define __TASKS_H__
+
+/* Builtin: tasks [-f file] [-j N] [-H] [-n] [target...]
+ * Brings targets up to date from a rule file, running up to N rules at
+ * once */
+int execute_tasks(char **words);
+
+#endif
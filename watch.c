@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "watch.h"
+#include "parser.h"
+#include "shell.h"
+#include "optimize.h"
+#include "expand.h"
+
+/**
+ * watch-run: re-run a command when files change.
+ *
+ * The command after "--" is constructed once and the same plan is
+ * executed on every change. Events are debounced: a run starts only once
+ * no new event has arrived for the debounce interval. With -c a run that
+ * is still going when a change arrives is cancelled (its process group
+ * gets SIGTERM) and restarted; otherwise the change is queued until it
+ * finishes. Ctrl-C ends watch-run and returns to the prompt.
+ */
+
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+		      IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+		      IN_DELETE_SELF | IN_MOVE_SELF)
+
+static volatile sig_atomic_t watch_interrupted;
+
+static void watch_sigint(int sig) {
+	watch_interrupted = 1;
+}
+
+/* Start the plan in its own process group, returns the child's pid */
+static pid_t watch_start(command *plan, int *pidfd) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		setpgid(0, 0);
+		signal(SIGINT, SIG_DFL);
+		execute_plan(plan, 1);
+		exit(last_status());
+	}
+	setpgid(pid, pid);
+	*pidfd = syscall(SYS_pidfd_open, pid, 0);
+	return pid;
+}
+
+/* Drain pending inotify events, re-adding watches on replaced files */
+static int watch_drain(int ifd, char **paths, int *wds, int npaths) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int events = 0;
+	ssize_t n;
+	while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + n) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->mask & IN_IGNORED) {
+				/* Editors often replace files by renaming */
+				int i;
+				for (i = 0; i < npaths; i++) {
+					if (wds[i] == ev->wd) {
+						wds[i] = inotify_add_watch(ifd, paths[i],
+									   WATCH_EVENTS);
+					}
+				}
+			}
+			events++;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return events;
+}
+
+/* Keyword: watch-run [-d ms] [-c] paths... -- command
+ * Re-runs the command whenever one of the paths changes */
+int execute_watch_run(char **tokens) {
+	int debounce = WATCH_DEBOUNCE_MS, cancel = 0;
+	int i = 1;
+
+	for (; tokens[i] && tokens[i][0] == '-' && strcmp(tokens[i], "--"); i++) {
+		if (!strcmp(tokens[i], "-c")) {
+			cancel = 1;
+		}
+		else if (!strcmp(tokens[i], "-d") && tokens[i+1]) {
+			debounce = atoi(tokens[++i]);
+		}
+		else {
+			break;
+		}
+	}
+	char **paths = tokens + i;
+	int npaths = 0;
+	while (paths[npaths] && strcmp(paths[npaths], "--")) {
+		npaths++;
+	}
+	if (!npaths || !paths[npaths] || !paths[npaths+1]) {
+		fprintf(stderr, "usage: watch-run [-d ms] [-c] paths... "
+			"-- command\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Parsed exactly once, executed on every change */
+	command *plan = construct_command(paths + npaths + 1);
+	if (!plan) {
+		return EXIT_FAILURE;
+	}
+	plan = optimize_command(plan);
+
+	int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd == -1) {
+		perror("inotify_init1");
+		release_command(plan);
+		return EXIT_FAILURE;
+	}
+	int *wds = malloc(npaths * sizeof(int));
+	for (i = 0; i < npaths; i++) {
+		wds[i] = inotify_add_watch(ifd, paths[i], WATCH_EVENTS);
+		if (wds[i] == -1) {
+			perror(paths[i]);
+		}
+	}
+
+	struct sigaction sa, old;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = watch_sigint;
+	sigaction(SIGINT, &sa, &old);
+	watch_interrupted = 0;
+
+	int pidfd = -1, pending = 1;
+	pid_t child = -1;
+	while (!watch_interrupted) {
+		if (pending && child == -1) {
+			pending = 0;
+			child = watch_start(plan, &pidfd);
+		}
+
+		struct pollfd pfd[2] = {
+			{ ifd, POLLIN, 0 },
+			{ pidfd, POLLIN, 0 }
+		};
+		/* Without a pidfd, fall back to checking the child periodically */
+		int timeout = child != -1 && pidfd == -1 ? 100 : -1;
+		if (poll(pfd, 2, timeout) == -1 && errno != EINTR) {
+			perror("poll");
+			break;
+		}
+
+		if (child != -1 && waitpid(child, NULL, WNOHANG) == child) {
+			child = -1;
+			if (pidfd != -1) {
+				close(pidfd);
+				pidfd = -1;
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN)) {
+			continue;
+		}
+
+		/* Debounce: wait until the burst of events is over */
+		while (watch_drain(ifd, paths, wds, npaths) > 0 &&
+		       !watch_interrupted) {
+			struct pollfd quiet = { ifd, POLLIN, 0 };
+			if (poll(&quiet, 1, debounce) <= 0) {
+				break;
+			}
+		}
+		pending = 1;
+
+		if (child != -1 && cancel) {
+			kill(-child, SIGTERM);
+			waitpid(child, NULL, 0);
+			child = -1;
+			if (pidfd != -1) {
+				close(pidfd);
+				pidfd = -1;
+			}
+		}
+	}
+
+	if (child != -1) {
+		kill(-child, SIGTERM);
+		waitpid(child, NULL, 0);
+	}
+	if (pidfd != -1) {
+		close(pidfd);
+	}
+	sigaction(SIGINT, &old, NULL);
+	close(ifd);
+	free(wds);
+	release_command(plan);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,8 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+/* Keyword: watch-run [-d ms] [-c] paths... -- command
+ * Re-runs the command whenever one of the paths changes */
+int execute_watch_run(char **tokens);
+
+#endif
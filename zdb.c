@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "zdb.h"
+#include "dirstack.h"
+
+/**
+ * Frecency database of visited directories, used by the j builtin.
+ *
+ * The database is a fixed-size file ($MYSHELL_Z, default ~/.myshell_z)
+ * mapped shared into every shell, so recording a visit is a scan of the
+ * mapping and a couple of stores under flock; no process is spawned.
+ * Ranks age like z: once their sum passes ZDB_MAX_TOTAL every rank is
+ * scaled down and entries that drop below 1 are forgotten.
+ */
+
+#define ZDB_MAGIC 0x5a44424d      /* "MBDZ" */
+#define ZDB_SLOTS 1024
+#define ZDB_PATH_MAX 248
+#define ZDB_MAX_TOTAL 9000.0f
+
+typedef struct zdb_entry_t {
+	float rank;                /* Number of visits, aged */
+	uint32_t last;             /* Time of the last visit */
+	char path[ZDB_PATH_MAX];   /* Directory, empty if the slot is free */
+} zdb_entry;
+
+typedef struct zdb_file_t {
+	uint32_t magic;
+	uint32_t count;            /* Slots in use are [0, count) */
+	float total;               /* Sum of all ranks */
+	uint32_t reserved;
+	zdb_entry entries[ZDB_SLOTS];
+} zdb_file;
+
+static zdb_file *zdb = NULL;
+static int zdb_fd = -1;
+
+/* Any process can write the file, so it is only trusted this far: at
+ * most ZDB_SLOTS entries, each path ending inside its slot. With the
+ * exclusive lock held, a mapping that breaks this is repaired. */
+static void zdb_check(void) {
+	uint32_t i;
+	if (zdb->count > ZDB_SLOTS) {
+		zdb->count = ZDB_SLOTS;
+	}
+	for (i = 0; i < zdb->count; i++) {
+		zdb->entries[i].path[ZDB_PATH_MAX - 1] = '\0';
+	}
+}
+
+/* Map the database on first use; returns -1 if it is unavailable */
+static int zdb_open(void) {
+	if (zdb) {
+		return 0;
+	}
+	if (zdb_fd == -2) {
+		return -1;
+	}
+
+	char buf[4096];
+	const char *path = getenv("MYSHELL_Z");
+	if (!path) {
+		const char *home = getenv("HOME");
+		if (!home) {
+			zdb_fd = -2;
+			return -1;
+		}
+		snprintf(buf, sizeof(buf), "%s/.myshell_z", home);
+		path = buf;
+	}
+
+	zdb_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (zdb_fd == -1 || ftruncate(zdb_fd, sizeof(zdb_file)) == -1) {
+		goto fail;
+	}
+	zdb = mmap(NULL, sizeof(zdb_file), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, zdb_fd, 0);
+	if (zdb == MAP_FAILED) {
+		zdb = NULL;
+		goto fail;
+	}
+	flock(zdb_fd, LOCK_EX);
+	if (zdb->magic != ZDB_MAGIC) {
+		memset(zdb, 0, sizeof(zdb_file));
+		zdb->magic = ZDB_MAGIC;
+	}
+	zdb_check();
+	flock(zdb_fd, LOCK_UN);
+	return 0;
+
+fail:
+	if (zdb_fd >= 0) {
+		close(zdb_fd);
+	}
+	zdb_fd = -2;
+	return -1;
+}
+
+static void zdb_remove(int i) {
+	zdb->total -= zdb->entries[i].rank;
+	zdb->entries[i] = zdb->entries[--zdb->count];
+}
+
+/* Scale all ranks down, forgetting rarely used directories */
+static void zdb_age(void) {
+	int i;
+	zdb->total = 0;
+	for (i = 0; i < (int)zdb->count; i++) {
+		zdb->entries[i].rank *= 0.99f;
+		zdb->total += zdb->entries[i].rank;
+	}
+	for (i = zdb->count - 1; i >= 0; i--) {
+		if (zdb->entries[i].rank < 1.0f) {
+			zdb_remove(i);
+		}
+	}
+}
+
+/* Record a visit to a directory in the frecency database */
+void zdb_visit(const char *path) {
+	if (strlen(path) >= ZDB_PATH_MAX || !strcmp(path, "/") ||
+	    zdb_open() == -1) {
+		return;
+	}
+	uint32_t now = time(NULL);
+	int i, lowest = 0;
+
+	flock(zdb_fd, LOCK_EX);
+	zdb_check();
+	for (i = 0; i < (int)zdb->count; i++) {
+		if (!strcmp(zdb->entries[i].path, path)) {
+			break;
+		}
+		if (zdb->entries[i].rank < zdb->entries[lowest].rank) {
+			lowest = i;
+		}
+	}
+	if (i == (int)zdb->count) {
+		if (zdb->count == ZDB_SLOTS) {
+			/* Full: the least ranked directory makes room */
+			zdb_remove(lowest);
+			i = zdb->count;
+		}
+		zdb->count++;
+		zdb->entries[i].rank = 0;
+		strcpy(zdb->entries[i].path, path);
+	}
+	zdb->entries[i].rank += 1.0f;
+	zdb->entries[i].last = now;
+	zdb->total += 1.0f;
+	if (zdb->total > ZDB_MAX_TOTAL) {
+		zdb_age();
+	}
+	flock(zdb_fd, LOCK_UN);
+}
+
+/* Weight a rank by how recently the directory was visited */
+static float frecency(zdb_entry *e, uint32_t now) {
+	uint32_t age = now - e->last;
+	if (age < 3600) {
+		return e->rank * 4;
+	}
+	if (age < 86400) {
+		return e->rank * 2;
+	}
+	if (age < 604800) {
+		return e->rank / 2;
+	}
+	return e->rank / 4;
+}
+
+/* Case-insensitive subsequence match of pattern within [s, end) */
+static const char *fuzzy_find(const char *s, const char *end,
+			      const char *pattern) {
+	while (*pattern && s < end) {
+		if (tolower((unsigned char)*s) == tolower((unsigned char)*pattern)) {
+			pattern++;
+		}
+		s++;
+	}
+	return *pattern ? NULL : s;
+}
+
+/**
+ * How well a path matches the patterns, in order: 3 when the last one is
+ * a substring of the last component, 2 when all are substrings, 1 for a
+ * fuzzy (subsequence) match, 0 for none.
+ */
+static int match_quality(const char *path, char **patterns) {
+	const char *end = path + strlen(path), *p = path;
+	const char *base = strrchr(path, '/');
+	int quality = 3, i;
+	for (i = 0; patterns[i]; i++) {
+		const char *hit = strcasestr(p, patterns[i]);
+		if (hit) {
+			p = hit + strlen(patterns[i]);
+			if (!patterns[i+1] && hit <= base) {
+				quality = quality < 2 ? quality : 2;
+			}
+			continue;
+		}
+		p = fuzzy_find(p, end, patterns[i]);
+		if (!p) {
+			return 0;
+		}
+		quality = 1;
+	}
+	return quality;
+}
+
+typedef struct zdb_match_t {
+	float score;
+	char path[ZDB_PATH_MAX];   /* Copied under the lock */
+} zdb_match;
+
+static int compare_match(const void *a, const void *b) {
+	float x = ((const zdb_match *)a)->score, y = ((const zdb_match *)b)->score;
+	return (x < y) - (x > y);
+}
+
+/**
+ * Jumps to the best ranked directory matching all patterns.
+ * "j -l pattern..." lists the matches and their scores instead.
+ */
+int execute_jump(char **words) {
+	int list = words[1] && !strcmp(words[1], "-l");
+	char **patterns = words + 1 + list;
+
+	if (zdb_open() == -1) {
+		fprintf(stderr, "j: no directory database\n");
+		return EXIT_FAILURE;
+	}
+
+	uint32_t now = time(NULL);
+	zdb_match *matches = malloc(ZDB_SLOTS * sizeof(zdb_match));
+	int i, n = 0, count;
+	flock(zdb_fd, LOCK_SH);
+	/* Only read here: bound what a corrupt file could make us scan */
+	count = zdb->count < ZDB_SLOTS ? (int)zdb->count : ZDB_SLOTS;
+	for (i = 0; i < count; i++) {
+		memcpy(matches[n].path, zdb->entries[i].path, ZDB_PATH_MAX - 1);
+		matches[n].path[ZDB_PATH_MAX - 1] = '\0';
+		int q = match_quality(matches[n].path, patterns);
+		if (q) {
+			matches[n].score = frecency(&zdb->entries[i], now) * q;
+			n++;
+		}
+	}
+	flock(zdb_fd, LOCK_UN);
+	qsort(matches, n, sizeof(zdb_match), compare_match);
+
+	int status = EXIT_FAILURE;
+	if (list) {
+		for (i = n - 1; i >= 0; i--) {
+			printf("%10.1f  %s\n", matches[i].score, matches[i].path);
+		}
+		status = EXIT_SUCCESS;
+	}
+	else {
+		/* Best match first; directories that are gone are skipped */
+		for (i = 0; i < n; i++) {
+			if (dir_change(matches[i].path) == 0) {
+				printf("%s\n", dir_pwd());
+				zdb_visit(dir_pwd());
+				status = EXIT_SUCCESS;
+				break;
+			}
+		}
+		if (status == EXIT_FAILURE) {
+			fprintf(stderr, "j: no match\n");
+		}
+	}
+	free(matches);
+	return status;
+}
@@ -0,0 +1,10 @@
+#ifndef __ZDB_H__
+#define __ZDB_H__
+
+/* Record a visit to a directory in the frecency database */
+void zdb_visit(const char *path);
+
+/* Builtin: j [-l] pattern... jumps to the best matching directory */
+int execute_jump(char **words);
+
+#endif